@@ -29,6 +29,7 @@
 
 #include <getopt.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -145,6 +146,15 @@ int main(int argc, char **argv)
   SUCCESS_OR_FAIL(pthread_barrierattr_getpshared(&barrier_attr, NULL));
   SUCCESS_OR_FAIL(pthread_barrierattr_destroy(&barrier_attr));
 
+  sem_t sem;
+  SUCCESS_OR_FAIL(sem_init(&sem, 0, 1));
+  SUCCESS_OR_FAIL(sem_wait(&sem));
+  SUCCESS_OR_FAIL(sem_trywait(&sem));
+  SUCCESS_OR_FAIL(sem_timedwait(&sem, &ts));
+  SUCCESS_OR_FAIL(sem_post(&sem));
+  SUCCESS_OR_FAIL(sem_getvalue(&sem, NULL));
+  SUCCESS_OR_FAIL(sem_destroy(&sem));
+
   printf("\nInterposition test successful\n");
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,631 @@
+/*
+ * File: test_semantics.c
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      Test that interposed pthread and semaphore functions behave as glibc's:
+ *      mutex types, condition variables, timeouts, rwlocks, semaphores and
+ *      barriers, with several threads.
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define DEFAULT_NUM_THREADS 4
+#define DEFAULT_NUM_ROUNDS 1000
+
+#define CHECK(cond)                                                 \
+  do                                                                \
+  {                                                                 \
+    if (!(cond))                                                    \
+    {                                                               \
+      printf("Failed, %s:%d: %s\n", __FILE__, __LINE__, STR(cond)); \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+#define RUN_TEST(test)         \
+  do                           \
+  {                            \
+    printf("%s: ", STR(test)); \
+    fflush(stdout);            \
+    test();                    \
+    printf("Success\n");       \
+    fflush(stdout);            \
+  } while (0)
+
+int num_threads = DEFAULT_NUM_THREADS;
+int num_rounds = DEFAULT_NUM_ROUNDS;
+
+/* ################################################################### *
+ * HELPERS
+ * ################################################################### */
+
+static struct timespec deadline_in_ms(long ms)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+  {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+static void run_threads(int n, void *(*fn)(void *), void *arg)
+{
+  pthread_t threads[n];
+  for (int i = 0; i < n; i++)
+    CHECK(pthread_create(&threads[i], NULL, fn, arg) == 0);
+  for (int i = 0; i < n; i++)
+    CHECK(pthread_join(threads[i], NULL) == 0);
+}
+
+static void *trylock_mutex(void *arg)
+{
+  pthread_mutex_t *mutex = (pthread_mutex_t *)arg;
+  int res = pthread_mutex_trylock(mutex);
+  if (res == 0)
+    CHECK(pthread_mutex_unlock(mutex) == 0);
+  return (void *)(long)res;
+}
+
+static void *unlock_mutex(void *arg)
+{
+  return (void *)(long)pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+/*
+ * Run fn(arg) in another thread and return its result.
+ */
+static int in_other_thread(void *(*fn)(void *), void *arg)
+{
+  pthread_t thread;
+  void *res;
+  CHECK(pthread_create(&thread, NULL, fn, arg) == 0);
+  CHECK(pthread_join(thread, &res) == 0);
+  return (int)(long)res;
+}
+
+static void init_mutex(pthread_mutex_t *mutex, int type)
+{
+  pthread_mutexattr_t attr;
+  CHECK(pthread_mutexattr_init(&attr) == 0);
+  CHECK(pthread_mutexattr_settype(&attr, type) == 0);
+  CHECK(pthread_mutex_init(mutex, &attr) == 0);
+  CHECK(pthread_mutexattr_destroy(&attr) == 0);
+}
+
+/* ################################################################### *
+ * MUTEXES
+ * ################################################################### */
+
+static void test_recursive_mutex()
+{
+  pthread_mutex_t mutex;
+  init_mutex(&mutex, PTHREAD_MUTEX_RECURSIVE);
+
+  CHECK(pthread_mutex_lock(&mutex) == 0);
+  CHECK(pthread_mutex_lock(&mutex) == 0);
+  CHECK(pthread_mutex_trylock(&mutex) == 0);
+  CHECK(in_other_thread(trylock_mutex, &mutex) == EBUSY);
+  CHECK(in_other_thread(unlock_mutex, &mutex) == EPERM);
+
+  CHECK(pthread_mutex_unlock(&mutex) == 0);
+  CHECK(pthread_mutex_unlock(&mutex) == 0);
+  CHECK(in_other_thread(trylock_mutex, &mutex) == EBUSY); // Still held once
+  CHECK(pthread_mutex_unlock(&mutex) == 0);
+  CHECK(pthread_mutex_unlock(&mutex) == EPERM);
+
+  CHECK(in_other_thread(trylock_mutex, &mutex) == 0);
+  CHECK(pthread_mutex_destroy(&mutex) == 0);
+}
+
+static void test_errorcheck_mutex()
+{
+  pthread_mutex_t mutex;
+  init_mutex(&mutex, PTHREAD_MUTEX_ERRORCHECK);
+
+  CHECK(pthread_mutex_unlock(&mutex) == EPERM);
+  CHECK(pthread_mutex_lock(&mutex) == 0);
+  CHECK(pthread_mutex_lock(&mutex) == EDEADLK);
+  CHECK(pthread_mutex_trylock(&mutex) == EBUSY);
+  CHECK(in_other_thread(unlock_mutex, &mutex) == EPERM);
+  CHECK(pthread_mutex_unlock(&mutex) == 0);
+  CHECK(pthread_mutex_unlock(&mutex) == EPERM);
+  CHECK(pthread_mutex_destroy(&mutex) == 0);
+}
+
+static void test_static_initializers()
+{
+  static pthread_mutex_t normal = PTHREAD_MUTEX_INITIALIZER;
+  static pthread_mutex_t recursive = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+  static pthread_mutex_t errorcheck = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+
+  CHECK(pthread_mutex_lock(&normal) == 0);
+  CHECK(pthread_mutex_trylock(&normal) == EBUSY);
+  CHECK(pthread_mutex_unlock(&normal) == 0);
+
+  CHECK(pthread_mutex_lock(&recursive) == 0);
+  CHECK(pthread_mutex_lock(&recursive) == 0);
+  CHECK(pthread_mutex_unlock(&recursive) == 0);
+  CHECK(pthread_mutex_unlock(&recursive) == 0);
+  CHECK(pthread_mutex_unlock(&recursive) == EPERM);
+
+  CHECK(pthread_mutex_lock(&errorcheck) == 0);
+  CHECK(pthread_mutex_lock(&errorcheck) == EDEADLK);
+  CHECK(pthread_mutex_unlock(&errorcheck) == 0);
+}
+
+static pthread_mutex_t timed_mutex;
+
+static void *timedlock_mutex(void *arg)
+{
+  struct timespec deadline = deadline_in_ms(50);
+  int res = pthread_mutex_timedlock(&timed_mutex, &deadline);
+
+  if (res == ETIMEDOUT)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    CHECK(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec));
+  }
+  else if (res == 0)
+    CHECK(pthread_mutex_unlock(&timed_mutex) == 0);
+  return (void *)(long)res;
+}
+
+static void test_mutex_timedlock()
+{
+  CHECK(pthread_mutex_init(&timed_mutex, NULL) == 0);
+  CHECK(pthread_mutex_lock(&timed_mutex) == 0);
+  CHECK(in_other_thread(timedlock_mutex, NULL) == ETIMEDOUT);
+  CHECK(pthread_mutex_unlock(&timed_mutex) == 0);
+  CHECK(in_other_thread(timedlock_mutex, NULL) == 0);
+  CHECK(pthread_mutex_destroy(&timed_mutex) == 0);
+}
+
+/* ################################################################### *
+ * CONDITION VARIABLES
+ * ################################################################### */
+
+typedef struct cond_test_t
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int ready;
+  int waiting;
+  int woken;
+  int relocked; // Waiters that locked the mutex again after the wait
+} cond_test_t;
+
+static void *wait_ready(void *arg)
+{
+  cond_test_t *t = (cond_test_t *)arg;
+
+  CHECK(pthread_mutex_lock(&t->mutex) == 0);
+  t->waiting++;
+  while (!t->ready)
+    CHECK(pthread_cond_wait(&t->cond, &t->mutex) == 0);
+  t->woken++;
+
+  // Owner again: recursive mutexes count one more lock, error-check ones let it unlock
+  int relocked = pthread_mutex_trylock(&t->mutex) == 0;
+  t->relocked += relocked;
+  CHECK(pthread_mutex_unlock(&t->mutex) == 0);
+  if (relocked)
+    CHECK(pthread_mutex_unlock(&t->mutex) == 0);
+  return NULL;
+}
+
+static void wake_waiters(cond_test_t *t, int n, int broadcast)
+{
+  while (1)
+  {
+    CHECK(pthread_mutex_lock(&t->mutex) == 0); // Released by the waiters while they wait
+    int waiting = t->waiting;
+    if (waiting == n)
+    {
+      t->ready = 1;
+      CHECK((broadcast ? pthread_cond_broadcast(&t->cond) : pthread_cond_signal(&t->cond)) == 0);
+    }
+    CHECK(pthread_mutex_unlock(&t->mutex) == 0);
+    if (waiting == n)
+      return;
+    sched_yield();
+  }
+}
+
+static void *wake_broadcast(void *arg)
+{
+  wake_waiters((cond_test_t *)arg, num_threads, 1);
+  return NULL;
+}
+
+static void test_cond_broadcast()
+{
+  cond_test_t t = {.ready = 0, .waiting = 0, .woken = 0, .relocked = 0};
+  CHECK(pthread_mutex_init(&t.mutex, NULL) == 0);
+  CHECK(pthread_cond_init(&t.cond, NULL) == 0);
+
+  pthread_t waker;
+  CHECK(pthread_create(&waker, NULL, wake_broadcast, &t) == 0);
+  run_threads(num_threads, wait_ready, &t);
+  CHECK(pthread_join(waker, NULL) == 0);
+  CHECK(t.woken == num_threads);
+  CHECK(t.relocked == 0);
+
+  CHECK(pthread_cond_destroy(&t.cond) == 0);
+  CHECK(pthread_mutex_destroy(&t.mutex) == 0);
+}
+
+static void test_cond_owner(int type)
+{
+  cond_test_t t = {.ready = 0, .waiting = 0, .woken = 0, .relocked = 0};
+  init_mutex(&t.mutex, type);
+  CHECK(pthread_cond_init(&t.cond, NULL) == 0);
+
+  pthread_t waiter;
+  CHECK(pthread_create(&waiter, NULL, wait_ready, &t) == 0);
+  wake_waiters(&t, 1, 0);
+  CHECK(pthread_join(waiter, NULL) == 0);
+  CHECK(t.woken == 1);
+  CHECK(t.relocked == (type == PTHREAD_MUTEX_RECURSIVE));
+
+  // Left unlocked by the waiter
+  CHECK(pthread_mutex_trylock(&t.mutex) == 0);
+  CHECK(pthread_mutex_unlock(&t.mutex) == 0);
+
+  CHECK(pthread_cond_destroy(&t.cond) == 0);
+  CHECK(pthread_mutex_destroy(&t.mutex) == 0);
+}
+
+static void test_cond_recursive_mutex()
+{
+  test_cond_owner(PTHREAD_MUTEX_RECURSIVE);
+}
+
+static void test_cond_errorcheck_mutex()
+{
+  test_cond_owner(PTHREAD_MUTEX_ERRORCHECK);
+}
+
+static void test_cond_timedwait()
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  init_mutex(&mutex, PTHREAD_MUTEX_ERRORCHECK);
+  CHECK(pthread_cond_init(&cond, NULL) == 0);
+
+  CHECK(pthread_mutex_lock(&mutex) == 0);
+  struct timespec deadline = deadline_in_ms(50);
+  CHECK(pthread_cond_timedwait(&cond, &mutex, &deadline) == ETIMEDOUT);
+  CHECK(pthread_mutex_lock(&mutex) == EDEADLK); // Held again after the timeout
+  CHECK(pthread_mutex_unlock(&mutex) == 0);
+
+  CHECK(pthread_cond_destroy(&cond) == 0);
+  CHECK(pthread_mutex_destroy(&mutex) == 0);
+}
+
+/* ################################################################### *
+ * RWLOCKS
+ * ################################################################### */
+
+typedef struct rwlock_test_t
+{
+  pthread_rwlock_t rwlock;
+  pthread_barrier_t readers_in; // Only passed if all readers hold the lock together
+  volatile int readers;
+  volatile int writers;
+  volatile long counter;
+} rwlock_test_t;
+
+static void *read_together(void *arg)
+{
+  rwlock_test_t *t = (rwlock_test_t *)arg;
+  CHECK(pthread_rwlock_rdlock(&t->rwlock) == 0);
+  pthread_barrier_wait(&t->readers_in);
+  CHECK(pthread_rwlock_unlock(&t->rwlock) == 0);
+  return NULL;
+}
+
+static void *read_or_write(void *arg)
+{
+  rwlock_test_t *t = (rwlock_test_t *)arg;
+
+  for (int i = 0; i < num_rounds; i++)
+  {
+    if (i % 4 == 0)
+    {
+      CHECK(pthread_rwlock_wrlock(&t->rwlock) == 0);
+      CHECK(__sync_add_and_fetch(&t->writers, 1) == 1);
+      CHECK(t->readers == 0);
+      t->counter++;
+      __sync_sub_and_fetch(&t->writers, 1);
+    }
+    else
+    {
+      CHECK(pthread_rwlock_rdlock(&t->rwlock) == 0);
+      __sync_add_and_fetch(&t->readers, 1);
+      CHECK(t->writers == 0);
+      __sync_sub_and_fetch(&t->readers, 1);
+    }
+    CHECK(pthread_rwlock_unlock(&t->rwlock) == 0);
+  }
+  return NULL;
+}
+
+static void *timedwrlock_rwlock(void *arg)
+{
+  struct timespec deadline = deadline_in_ms(50);
+  return (void *)(long)pthread_rwlock_timedwrlock((pthread_rwlock_t *)arg, &deadline);
+}
+
+static void *tryrdlock_rwlock(void *arg)
+{
+  pthread_rwlock_t *rwlock = (pthread_rwlock_t *)arg;
+  int res = pthread_rwlock_tryrdlock(rwlock);
+  if (res == 0)
+    CHECK(pthread_rwlock_unlock(rwlock) == 0);
+  return (void *)(long)res;
+}
+
+static void test_rwlock()
+{
+  rwlock_test_t t = {.readers = 0, .writers = 0, .counter = 0};
+  CHECK(pthread_rwlock_init(&t.rwlock, NULL) == 0);
+  CHECK(pthread_barrier_init(&t.readers_in, NULL, num_threads) == 0);
+
+  run_threads(num_threads, read_together, &t);
+
+  CHECK(pthread_rwlock_rdlock(&t.rwlock) == 0);
+  CHECK(in_other_thread(tryrdlock_rwlock, &t.rwlock) == 0);
+  CHECK(in_other_thread(timedwrlock_rwlock, &t.rwlock) == ETIMEDOUT);
+  CHECK(pthread_rwlock_unlock(&t.rwlock) == 0);
+
+  CHECK(pthread_rwlock_wrlock(&t.rwlock) == 0);
+  CHECK(in_other_thread(tryrdlock_rwlock, &t.rwlock) == EBUSY);
+  CHECK(pthread_rwlock_unlock(&t.rwlock) == 0);
+
+  run_threads(num_threads, read_or_write, &t);
+  CHECK(t.counter == (long)num_threads * ((num_rounds + 3) / 4));
+
+  CHECK(pthread_barrier_destroy(&t.readers_in) == 0);
+  CHECK(pthread_rwlock_destroy(&t.rwlock) == 0);
+}
+
+/* ################################################################### *
+ * SEMAPHORES
+ * ################################################################### */
+
+static sem_t items;
+static volatile long consumed = 0;
+
+static void *post_items(void *arg)
+{
+  for (int i = 0; i < num_rounds; i++)
+    CHECK(sem_post(&items) == 0);
+  return NULL;
+}
+
+static void *wait_items(void *arg)
+{
+  for (int i = 0; i < num_rounds; i++)
+  {
+    CHECK(sem_wait(&items) == 0);
+    __sync_add_and_fetch(&consumed, 1);
+  }
+  return NULL;
+}
+
+static void *post_and_wait_items(void *arg)
+{
+  return (long)arg & 1 ? post_items(NULL) : wait_items(NULL);
+}
+
+static void ignore_signal(int sig) {}
+
+static void test_semaphore()
+{
+  int value;
+  CHECK(sem_init(&items, 0, 0) == 0);
+
+  CHECK(sem_trywait(&items) == -1 && errno == EAGAIN);
+  struct timespec deadline = deadline_in_ms(50);
+  CHECK(sem_timedwait(&items, &deadline) == -1 && errno == ETIMEDOUT);
+
+  pthread_t threads[2 * num_threads];
+  for (long i = 0; i < 2 * num_threads; i++)
+    CHECK(pthread_create(&threads[i], NULL, post_and_wait_items, (void *)i) == 0);
+  for (int i = 0; i < 2 * num_threads; i++)
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  CHECK(consumed == (long)num_threads * num_rounds);
+  CHECK(sem_getvalue(&items, &value) == 0 && value == 0);
+
+  CHECK(sem_post(&items) == 0);
+  CHECK(sem_post(&items) == 0);
+  CHECK(sem_getvalue(&items, &value) == 0 && value == 2);
+  CHECK(sem_trywait(&items) == 0);
+  CHECK(sem_wait(&items) == 0);
+
+  // Waits interrupted by a signal handler return EINTR
+  struct sigaction action = {.sa_handler = ignore_signal}, old_action;
+  CHECK(sigaction(SIGALRM, &action, &old_action) == 0);
+  alarm(1);
+  CHECK(sem_wait(&items) == -1 && errno == EINTR);
+  deadline = deadline_in_ms(10000);
+  alarm(1);
+  CHECK(sem_timedwait(&items, &deadline) == -1 && errno == EINTR);
+  CHECK(sigaction(SIGALRM, &old_action, NULL) == 0);
+
+  CHECK(sem_destroy(&items) == 0);
+}
+
+/* ################################################################### *
+ * BARRIERS
+ * ################################################################### */
+
+typedef struct barrier_test_t
+{
+  pthread_barrier_t barrier;
+  volatile int *arrived; // Per round
+  volatile int serial;   // Threads given PTHREAD_BARRIER_SERIAL_THREAD
+} barrier_test_t;
+
+static void *cross_barrier(void *arg)
+{
+  barrier_test_t *t = (barrier_test_t *)arg;
+
+  for (int i = 0; i < num_rounds; i++)
+  {
+    __sync_add_and_fetch(&t->arrived[i], 1);
+    int res = pthread_barrier_wait(&t->barrier);
+    CHECK(res == 0 || res == PTHREAD_BARRIER_SERIAL_THREAD);
+    if (res == PTHREAD_BARRIER_SERIAL_THREAD)
+      __sync_add_and_fetch(&t->serial, 1);
+    CHECK(t->arrived[i] == num_threads); // Nobody left before all arrived
+  }
+  return NULL;
+}
+
+static void test_barrier()
+{
+  barrier_test_t *t = malloc(sizeof(barrier_test_t));
+  CHECK(t != NULL);
+  t->arrived = calloc(num_rounds, sizeof(int));
+  t->serial = 0;
+
+  // Initialized whatever the memory held before
+  const int garbage[] = {0x01, 0x02, 0xff};
+  for (int i = 0; i < 3; i++)
+  {
+    memset(&t->barrier, garbage[i], sizeof(t->barrier));
+    CHECK(pthread_barrier_init(&t->barrier, NULL, 1) == 0);
+    CHECK(pthread_barrier_wait(&t->barrier) == PTHREAD_BARRIER_SERIAL_THREAD);
+    CHECK(pthread_barrier_destroy(&t->barrier) == 0);
+  }
+
+  CHECK(pthread_barrier_init(&t->barrier, NULL, 0) == EINVAL);
+
+  CHECK(pthread_barrier_init(&t->barrier, NULL, num_threads) == 0);
+  run_threads(num_threads, cross_barrier, t);
+  CHECK(t->serial == num_rounds);
+  CHECK(pthread_barrier_destroy(&t->barrier) == 0);
+
+  free((void *)t->arrived);
+  free(t);
+}
+
+int main(int argc, char **argv)
+{
+  int i, c;
+
+  struct option long_options[] = {
+      {"help", no_argument, NULL, 'h'},
+      {"num-threads", required_argument, NULL, 'n'},
+      {"rounds", required_argument, NULL, 'r'},
+      {NULL, 0, NULL, 0}};
+
+  while (1)
+  {
+    i = 0;
+    c = getopt_long(argc, argv, "hn:r:", long_options, &i);
+
+    if (c == -1)
+      break;
+
+    if (c == 0 && long_options[i].flag == 0)
+      c = long_options[i].val;
+
+    switch (c)
+    {
+    case 0:
+      /* Flag is automatically set */
+      break;
+    case 'h':
+      printf("test_semantics -- Test the behavior of interposed pthread functions\n");
+      printf("\n");
+      printf("Usage:\n");
+      printf("  interpose.sh test_semantics [options...]\n");
+      printf("\n");
+      printf("Options:\n");
+      printf("  -h, --help\n");
+      printf("        Print this message\n");
+      printf("  -n, --num-threads <int>\n");
+      printf("        Number of threads (default=" XSTR(DEFAULT_NUM_THREADS) ")\n");
+      printf("  -r, --rounds <int>\n");
+      printf("        Rounds of the rwlock, semaphore and barrier tests (default=" XSTR(DEFAULT_NUM_ROUNDS) ")\n");
+      exit(0);
+    case 'n':
+      num_threads = atoi(optarg);
+      break;
+    case 'r':
+      num_rounds = atoi(optarg);
+      break;
+    case '?':
+      printf("Use -h or --help for help\n");
+      exit(0);
+    default:
+      exit(1);
+    }
+  }
+
+  if (num_threads < 1 || num_rounds < 1)
+  {
+    printf("Number of threads and rounds must be positive\n");
+    exit(1);
+  }
+
+  printf("The test fails if it does not finish or exits early.\n\n");
+
+  RUN_TEST(test_recursive_mutex);
+  RUN_TEST(test_errorcheck_mutex);
+  RUN_TEST(test_static_initializers);
+  RUN_TEST(test_mutex_timedlock);
+  RUN_TEST(test_cond_broadcast);
+  RUN_TEST(test_cond_recursive_mutex);
+  RUN_TEST(test_cond_errorcheck_mutex);
+  RUN_TEST(test_cond_timedwait);
+  RUN_TEST(test_rwlock);
+  RUN_TEST(test_semaphore);
+  RUN_TEST(test_barrier);
+
+  printf("\nSemantics test successful\n");
+  return EXIT_SUCCESS;
+}
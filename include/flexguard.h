@@ -57,11 +57,54 @@
 #include "extend.h"
 #endif
 
+#if defined(FLEXGUARD_SCX) && !defined(BPF)
+#error "The sched_ext scheduler (TIMESLICE_EXTENSION=SCX, FLEXGUARD_SCX_YIELD=1) requires the BPF program (NOBPF=0)"
+#endif
+
+#ifdef FLEXGUARD_NUMA
+#ifndef HYBRID_MCS
+#error "The NUMA-aware variant of FlexGuard requires HYBRID_VERSION=MCS"
+#endif
+#include "litl/topology.h"
+
+/*
+ * Consecutive handoffs to waiters of the same NUMA node
+ * before the lock is released to the other nodes.
+ */
+#define FLEXGUARD_NUMA_BATCH 100
+
+/*
+ * Per-node MCS queue of the NUMA-aware (cohort) variant.
+ * The heads of every node compete on lock_value, and the holder can hand
+ * the lock to a waiter of its own node without releasing lock_value.
+ */
+typedef struct flexguard_numa_queue_t
+{
+  union
+  {
+    struct
+    {
+      flexguard_qnode_ptr queue;
+      volatile int grant; // Lock handed to a waiter of this node, still to be taken
+      int batch_count;    // Handoffs left before releasing to other nodes
+    };
+    uint8_t padding[CACHE_LINE_SIZE];
+  };
+} flexguard_numa_queue_t;
+#endif
+
 typedef struct flexguard_lock_t
 {
   union
   {
-    volatile int lock_value;
+    struct
+    {
+      volatile int lock_value;
+      uint32_t id; // Index in lock_preempted_cs, FLEXGUARD_UNREGISTERED_LOCK if not registered.
+#ifdef FLEXGUARD_NUMA
+      int home; // Node of the holder
+#endif
+    };
 #ifdef ADD_PADDING
     uint8_t padding2[CACHE_LINE_SIZE];
 #endif
@@ -86,17 +129,127 @@ typedef struct flexguard_lock_t
     uint8_t padding3[CACHE_LINE_SIZE];
 #endif
   };
+
+#ifdef FLEXGUARD_NUMA
+  flexguard_numa_queue_t nodes[NUMA_NODES];
+#endif
 } flexguard_lock_t;
 #define FLEXGUARD_INITIALIZER \
   {                           \
   }
 
+/*
+ * Reader-writer lock.
+ * Writers are serialized by a FlexGuard lock, then wait for readers to drain.
+ * state: RWLOCK_WRITER | RWLOCK_WRITER_SLEEPING | number of readers * RWLOCK_READER
+ */
+typedef struct flexguard_rwlock_t
+{
+  flexguard_lock_t writer_lock;
+
+  union
+  {
+    struct
+    {
+      volatile uint32_t state;
+      volatile uint32_t write_locked;
+    };
+#ifdef ADD_PADDING
+    uint8_t padding1[CACHE_LINE_SIZE];
+#endif
+  };
+
+  union
+  {
+    struct
+    {
+      volatile uint32_t writer_seq;
+      volatile uint32_t sleeping_readers;
+    };
+#ifdef ADD_PADDING
+    uint8_t padding2[CACHE_LINE_SIZE];
+#endif
+  };
+} flexguard_rwlock_t;
+#define FLEXGUARD_RWLOCK_INITIALIZER \
+  {                                  \
+  }
+
+/*
+ * Sense-reversing barrier: the last thread to arrive starts a new generation.
+ * Waiters spin on seq, or sleep on it while registered threads are preempted
+ * (more runnable threads than cpus, possibly those still to arrive).
+ */
+typedef struct flexguard_barrier_t
+{
+  union
+  {
+    struct
+    {
+      volatile uint32_t arrived;
+      uint32_t count;
+    };
+#ifdef ADD_PADDING
+    uint8_t padding1[CACHE_LINE_SIZE];
+#endif
+  };
+
+  union
+  {
+    struct
+    {
+      volatile uint32_t seq;
+      volatile uint32_t sleepers;
+      volatile uint32_t leaving; // Threads of the last generation still in wait
+    };
+#ifdef ADD_PADDING
+    uint8_t padding2[CACHE_LINE_SIZE];
+#endif
+  };
+} flexguard_barrier_t;
+
+/*
+ * Counting semaphore. Waiters spin while the value is 0, and sleep once other
+ * waiters sleep, threads are preempted (the poster may be one of them), or
+ * after FLEXGUARD_SEM_MAX_SPIN cycles as semaphores can stay empty for long.
+ * A single word, not padded, so that it fits in a sem_t.
+ */
+#define FLEXGUARD_SEM_MAX_SPIN 100000
+
+typedef struct flexguard_sem_t
+{
+  volatile uint32_t value;
+  volatile uint32_t sleepers;
+} flexguard_sem_t;
+
+#ifdef HYBRID_MCS
+/*
+ * Compact lock fitting in 32 bits (e.g. pthread_spinlock_t or lock arrays).
+ * Low byte: lock_value as in flexguard_lock_t (0 free, 1 held, 2 sleepers),
+ * high 24 bits: thread id + 1 of the MCS queue tail, 0 if empty.
+ * Compact locks are not registered, their waiters use num_preempted_cs.
+ */
+#define FLEXGUARD_SPIN_TAIL_SHIFT 8
+#define FLEXGUARD_SPIN_VALUE_MASK ((1U << FLEXGUARD_SPIN_TAIL_SHIFT) - 1)
+
+typedef union
+{
+  volatile uint32_t val;
+  volatile uint8_t lock_value; // Low byte of val (little-endian)
+} flexguard_spinlock_t;
+#define FLEXGUARD_SPINLOCK_INITIALIZER \
+  {                                    \
+    0                                  \
+  }
+#endif
+
 typedef union
 {
   struct
   {
     uint32_t seq;
     uint32_t target;
+    flexguard_lock_t *lock; // Lock of the waiters, requeued to it on broadcast, NULL without waiters
   };
 #ifdef ADD_PADDING
   uint8_t padding[CACHE_LINE_SIZE];
@@ -117,8 +270,39 @@ int flexguard_init(flexguard_lock_t *the_lock);
 void flexguard_destroy(flexguard_lock_t *the_lock);
 void flexguard_lock(flexguard_lock_t *the_lock);
 int flexguard_trylock(flexguard_lock_t *the_lock);
+int flexguard_timedlock(flexguard_lock_t *the_lock, const struct timespec *abstime);
 void flexguard_unlock(flexguard_lock_t *the_lock);
 
+int flexguard_rwlock_init(flexguard_rwlock_t *the_lock);
+void flexguard_rwlock_destroy(flexguard_rwlock_t *the_lock);
+void flexguard_rwlock_rdlock(flexguard_rwlock_t *the_lock);
+void flexguard_rwlock_wrlock(flexguard_rwlock_t *the_lock);
+int flexguard_rwlock_tryrdlock(flexguard_rwlock_t *the_lock);
+int flexguard_rwlock_trywrlock(flexguard_rwlock_t *the_lock);
+int flexguard_rwlock_timedrdlock(flexguard_rwlock_t *the_lock, const struct timespec *abstime);
+int flexguard_rwlock_timedwrlock(flexguard_rwlock_t *the_lock, const struct timespec *abstime);
+void flexguard_rwlock_unlock(flexguard_rwlock_t *the_lock);
+
+#ifdef HYBRID_MCS
+int flexguard_spin_init(flexguard_spinlock_t *the_lock);
+void flexguard_spin_destroy(flexguard_spinlock_t *the_lock);
+void flexguard_spin_lock(flexguard_spinlock_t *the_lock);
+int flexguard_spin_trylock(flexguard_spinlock_t *the_lock);
+void flexguard_spin_unlock(flexguard_spinlock_t *the_lock);
+#endif
+
+int flexguard_barrier_init(flexguard_barrier_t *barrier, const int *attr, unsigned count);
+int flexguard_barrier_destroy(flexguard_barrier_t *barrier);
+int flexguard_barrier_wait(flexguard_barrier_t *barrier);
+
+int flexguard_sem_init(flexguard_sem_t *sem, int pshared, unsigned value);
+int flexguard_sem_destroy(flexguard_sem_t *sem);
+int flexguard_sem_wait(flexguard_sem_t *sem);
+int flexguard_sem_trywait(flexguard_sem_t *sem);
+int flexguard_sem_timedwait(flexguard_sem_t *sem, const struct timespec *abstime);
+int flexguard_sem_post(flexguard_sem_t *sem);
+int flexguard_sem_getvalue(flexguard_sem_t *sem, int *value);
+
 int flexguard_cond_init(flexguard_cond_t *cond);
 int flexguard_cond_wait(flexguard_cond_t *cond, flexguard_lock_t *the_lock);
 int flexguard_cond_timedwait(flexguard_cond_t *cond, flexguard_lock_t *the_lock, const struct timespec *ts);
@@ -135,8 +319,34 @@ int flexguard_cond_destroy(flexguard_cond_t *cond);
 #define LOCKIF_DESTROY flexguard_destroy
 #define LOCKIF_LOCK flexguard_lock
 #define LOCKIF_TRYLOCK flexguard_trylock
+#define LOCKIF_TIMEDLOCK flexguard_timedlock
 #define LOCKIF_UNLOCK flexguard_unlock
 #define LOCKIF_INITIALIZER FLEXGUARD_INITIALIZER
+#if !defined(ADD_PADDING) && !defined(HYBRID_CLH) && !defined(FLEXGUARD_NUMA)
+#define LOCKIF_EMBEDDABLE // Zeroed locks are unlocked, unregistered locks
+#endif
+
+#define LOCKIF_RWLOCK_T flexguard_rwlock_t
+#define LOCKIF_RWLOCK_INIT flexguard_rwlock_init
+#define LOCKIF_RWLOCK_DESTROY flexguard_rwlock_destroy
+#define LOCKIF_RWLOCK_RDLOCK flexguard_rwlock_rdlock
+#define LOCKIF_RWLOCK_WRLOCK flexguard_rwlock_wrlock
+#define LOCKIF_RWLOCK_TRYRDLOCK flexguard_rwlock_tryrdlock
+#define LOCKIF_RWLOCK_TRYWRLOCK flexguard_rwlock_trywrlock
+#define LOCKIF_RWLOCK_TIMEDRDLOCK flexguard_rwlock_timedrdlock
+#define LOCKIF_RWLOCK_TIMEDWRLOCK flexguard_rwlock_timedwrlock
+#define LOCKIF_RWLOCK_UNLOCK flexguard_rwlock_unlock
+#define LOCKIF_RWLOCK_INITIALIZER FLEXGUARD_RWLOCK_INITIALIZER
+
+#ifdef HYBRID_MCS
+#define LOCKIF_SPINLOCK_T flexguard_spinlock_t
+#define LOCKIF_SPIN_INIT flexguard_spin_init
+#define LOCKIF_SPIN_DESTROY flexguard_spin_destroy
+#define LOCKIF_SPIN_LOCK flexguard_spin_lock
+#define LOCKIF_SPIN_TRYLOCK flexguard_spin_trylock
+#define LOCKIF_SPIN_UNLOCK flexguard_spin_unlock
+#define LOCKIF_SPINLOCK_INITIALIZER FLEXGUARD_SPINLOCK_INITIALIZER
+#endif
 
 #define LOCKIF_COND_T flexguard_cond_t
 #define LOCKIF_COND_INIT flexguard_cond_init
@@ -147,4 +357,18 @@ int flexguard_cond_destroy(flexguard_cond_t *cond);
 #define LOCKIF_COND_BROADCAST flexguard_cond_broadcast
 #define LOCKIF_COND_INITIALIZER FLEXGUARD_COND_INITIALIZER
 
+#define LOCKIF_SEM_T flexguard_sem_t
+#define LOCKIF_SEM_INIT flexguard_sem_init
+#define LOCKIF_SEM_DESTROY flexguard_sem_destroy
+#define LOCKIF_SEM_WAIT flexguard_sem_wait
+#define LOCKIF_SEM_TRYWAIT flexguard_sem_trywait
+#define LOCKIF_SEM_TIMEDWAIT flexguard_sem_timedwait
+#define LOCKIF_SEM_POST flexguard_sem_post
+#define LOCKIF_SEM_GETVALUE flexguard_sem_getvalue
+
+#define LOCKIF_BARRIER_T flexguard_barrier_t
+#define LOCKIF_BARRIER_INIT flexguard_barrier_init
+#define LOCKIF_BARRIER_DESTROY flexguard_barrier_destroy
+#define LOCKIF_BARRIER_WAIT flexguard_barrier_wait
+
 #endif
@@ -31,6 +31,32 @@
 #ifndef _FLEXGUARD_BPF_H_
 #define _FLEXGUARD_BPF_H_
 
+#ifndef __arena
+#define __arena // Arena pointers are plain pointers in user space
+#endif
+
+/*
+ * Number of nested locks whose ids are recorded in a qnode.
+ * Deeper locks are not accounted for on preemption.
+ */
+#define FLEXGUARD_MAX_NESTED_LOCKS 8
+
+/*
+ * Lock id of locks that were not registered by flexguard_init
+ * or exceeded MAX_ARENA_LOCKS. Their waiters use num_preempted_cs.
+ */
+#define FLEXGUARD_UNREGISTERED_LOCK 0
+
+/*
+ * Values of qnode->phase, read by the BPF program to decide whether a
+ * thread preempted with cs_counter > 0 was critical for its last lock.
+ * Plain stores are enough: sched_switch runs on the cpu the thread ran on.
+ */
+#define FLEXGUARD_PHASE_HOLDING 0  // Lock held, or possibly acquired by the pending atomic
+#define FLEXGUARD_PHASE_FASTPATH 1 // Not critical, lock not acquired nor queued for
+#define FLEXGUARD_PHASE_ENQUEUED 2 // Behind a predecessor, critical once granted
+#define FLEXGUARD_PHASE_SPINNING 3 // Head of the queue or TAS/futex phase
+
 typedef struct flexguard_qnode_t
 {
   union
@@ -38,42 +64,137 @@ typedef struct flexguard_qnode_t
     struct
     {
 #ifdef HYBRID_TICKET
-      uint32_t ticket;
+      volatile uint32_t ticket;
+      volatile uint32_t *calling; // Calling counter of the lock the ticket was taken from
 #elif defined(HYBRID_CLH)
-      volatile uint8_t done;
-      volatile struct flexguard_qnode_t *pred;
+      volatile uint8_t done;                             // CLH node: set once its owner left the queue
+      volatile struct flexguard_qnode_t *volatile pred;  // Node spun on while waiting
+      volatile struct flexguard_qnode_t *clh_node;       // CLH node owned by the thread, usable once done
 #elif defined(HYBRID_MCS)
       volatile uint8_t waiting;
       volatile struct flexguard_qnode_t *volatile next;
 #endif
 
+      uint32_t next_free; // Id + 1 of the next qnode in the free list, 0 for none
+
 #ifdef BPF
       volatile uint8_t cs_counter;
+      volatile uint8_t rcs_counter; // Read-side critical sections (rwlocks)
+      volatile uint32_t held_locks[FLEXGUARD_MAX_NESTED_LOCKS]; // Ids of the cs_counter locks held or being acquired
+      volatile uint8_t descheduled; // Set while the thread is off-cpu waiting in the MCS queue
+      volatile uint8_t phase;       // Progress in acquiring held_locks[cs_counter - 1]
+#ifdef TIMESLICE_EXTENSION_SCX
+      volatile uint8_t extended; // Time slice extended by the sched_ext scheduler, yield once out of critical sections
+#endif
 #endif
     };
 
     uint8_t padding[CACHE_LINE_SIZE];
   };
 } flexguard_qnode_t;
-typedef volatile flexguard_qnode_t *flexguard_qnode_ptr;
+typedef volatile flexguard_qnode_t __arena *flexguard_qnode_ptr;
 
-#ifdef BPF
-typedef struct hybrid_addresses_t
+typedef volatile int64_t num_preempted_cs_t;
+
+/*
+ * Preempted holder count of a lock, alone in its cache line so that an update
+ * does not disturb the waiters of neighbouring locks.
+ */
+typedef union
+{
+  num_preempted_cs_t count;
+#ifdef ADD_PADDING
+  uint8_t padding[CACHE_LINE_SIZE];
+#endif
+} flexguard_lock_preempted_t;
+
+/*
+ * Tables of a process in the BPF arena shared with user space: preempted
+ * counts, qnodes indexed by thread id, then preempted holder counts indexed
+ * by lock id. Forked children share the arena and the BPF program with their
+ * parent, each process using its own tables. Arena pages are allocated when
+ * first touched, so the tables only take the memory of the entries in use.
+ */
+typedef struct flexguard_process_t
 {
   union
   {
     struct
     {
-      void *lock;
-      void *fastpath;
-      void *fastpath_out;
-      void *lock_check_rcx_null;
-      void *phase2;
+      num_preempted_cs_t num_preempted_cs;
+      num_preempted_cs_t num_preempted_readers;
+      num_preempted_cs_t num_preempted_threads; // Registered threads preempted while runnable
+      volatile int tgid;                        // Process using the tables, 0 if free
     };
     uint8_t padding[CACHE_LINE_SIZE];
   };
-} hybrid_addresses_t;
+  flexguard_qnode_t qnodes[MAX_ARENA_THREADS];
+  flexguard_lock_preempted_t lock_preempted_cs[MAX_ARENA_LOCKS];
+} flexguard_process_t;
+
+#define FLEXGUARD_ARENA_PROCESSES_OFFSET ARENA_PAGE_SIZE
+#define FLEXGUARD_ARENA_SIZE (FLEXGUARD_ARENA_PROCESSES_OFFSET + FLEXGUARD_MAX_PROCESSES * sizeof(flexguard_process_t))
+
+/*
+ * Per-task state of registered threads (BPF task storage).
+ */
+typedef struct flexguard_task_t
+{
+  int process; // Index of the tables of its process
+  int thread_id;
+  uint32_t preempted; // PREEMPTED_* flags, cleared when the task runs again
+  uint8_t sleep_blocking; // Sleeps in critical sections are accounted as preemptions
+  uint64_t sleep_start;
+  uint64_t sleep_average; // Moving average of the sleeps in critical sections (ns)
+} flexguard_task_t;
+
+/*
+ * Context of the register_thread BPF program.
+ */
+typedef struct flexguard_register_args_t
+{
+  int process;
+  int thread_id;
+} flexguard_register_args_t;
+
+/*
+ * Values stored in flexguard_task_t.preempted.
+ * A thread can be preempted while holding both a lock and read locks.
+ */
+#define PREEMPTED_CS 1     // Preempted holding or acquiring held_locks[cs_counter - 1]
+#define PREEMPTED_READER 2
+#define PREEMPTED_NESTED 4 // Preempted holding held_locks[0..cs_counter - 2]
+#define PREEMPTED_WAITER 8 // Descheduled while waiting in the MCS queue
+#define PREEMPTED_RUNNABLE 16 // Preempted while runnable, whatever it was doing
+#define PREEMPTED_SLEEPING 32 // Went to sleep holding locks, accounted if sleep_blocking
+
+/*
+ * Sleeps in critical sections are accounted once their average goes above
+ * FLEXGUARD_SLEEP_BLOCK_NS, and no longer once it goes below
+ * FLEXGUARD_SLEEP_SPIN_NS, so that short sleeps do not make waiters block.
+ */
+#define FLEXGUARD_SLEEP_BLOCK_NS (100 * 1000)
+#define FLEXGUARD_SLEEP_SPIN_NS (20 * 1000)
+
+/*
+ * sched_ext scheduler, loaded with the monitor when one of its policies is enabled.
+ */
+#if defined(TIMESLICE_EXTENSION_SCX) || defined(FLEXGUARD_SCX_YIELD)
+#define FLEXGUARD_SCX
 #endif
 
-typedef volatile int64_t num_preempted_cs_t;
+/*
+ * Time slice extension granted once by the sched_ext scheduler to a thread
+ * whose slice expires in a critical section.
+ */
+#define FLEXGUARD_SLICE_EXTENSION_NS (100 * 1000)
+
+/*
+ * Dispatch queues of the directed yield policy: lock holders, then all other
+ * threads. Holders run first for at most FLEXGUARD_HOLDERS_BATCH dispatches in
+ * a row, so that the other threads are not starved.
+ */
+#define FLEXGUARD_DSQ_HOLDERS 0
+#define FLEXGUARD_DSQ_SHARED 1
+#define FLEXGUARD_HOLDERS_BATCH 8
 #endif
\ No newline at end of file
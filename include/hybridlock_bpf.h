@@ -31,6 +31,10 @@
 #ifndef _HYBRIDLOCK_BPF_H_
 #define _HYBRIDLOCK_BPF_H_
 
+#ifndef __arena
+#define __arena // Arena pointers are plain pointers in user space
+#endif
+
 typedef struct hybrid_qnode_t
 {
   union
@@ -40,6 +44,7 @@ typedef struct hybrid_qnode_t
       volatile int locking_id;
       volatile uint8_t is_running;
       uint8_t is_holder_preempted;
+      uint32_t next_free; // Id + 1 of the next qnode in the free list, 0 for none
 
 #ifdef HYBRID_TICKET
       uint32_t ticket;
@@ -59,7 +64,7 @@ typedef struct hybrid_qnode_t
     uint8_t padding[CACHE_LINE_SIZE];
   };
 } hybrid_qnode_t;
-typedef volatile hybrid_qnode_t *hybrid_qnode_ptr;
+typedef volatile hybrid_qnode_t __arena *hybrid_qnode_ptr;
 
 #ifdef BPF
 typedef struct hybrid_addresses_t
@@ -85,6 +90,14 @@ typedef struct hybrid_addresses_t
 } hybrid_addresses_t;
 #endif
 
+/*
+ * Context of the register_thread BPF program.
+ */
+typedef struct hybrid_register_args_t
+{
+  int thread_id;
+} hybrid_register_args_t;
+
 typedef struct hybrid_lock_info_t
 {
   union
@@ -108,4 +121,13 @@ typedef struct hybrid_lock_info_t
 #endif
   };
 } hybrid_lock_info_t;
+
+/*
+ * Layout of the BPF arena shared with user space: qnodes indexed by thread id,
+ * then lock information indexed by lock id. Arena pages are allocated when
+ * first touched, so the tables only take the memory of the entries in use.
+ */
+#define HYBRID_ARENA_QNODES_OFFSET ARENA_PAGE_SIZE
+#define HYBRID_ARENA_LOCKS_OFFSET (HYBRID_ARENA_QNODES_OFFSET + MAX_ARENA_THREADS * sizeof(hybrid_qnode_t))
+#define HYBRID_ARENA_SIZE (HYBRID_ARENA_LOCKS_OFFSET + MAX_ARENA_LOCKS * sizeof(hybrid_lock_info_t))
 #endif
\ No newline at end of file
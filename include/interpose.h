@@ -33,14 +33,29 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include "utils.h"
 #include "atomic_ops.h"
 #include "lock_if.h"
 
 #define INTERPOSE_RWLOCK 1
+#ifdef LOCKIF_SPINLOCK_T
+#define INTERPOSE_SPINLOCK 1 // Compact locks stored in the pthread_spinlock_t itself
+#else
 #define INTERPOSE_SPINLOCK 0
+#endif
+#ifdef LOCKIF_SEM_T
+#define INTERPOSE_SEMAPHORE 1 // Semaphores stored in the sem_t itself
+#else
+#define INTERPOSE_SEMAPHORE 0
+#endif
+#ifdef LOCKIF_BARRIER_T
+#define INTERPOSE_BARRIERS 1 // Only locks with their own barrier, not the mutex and condvar fallback
+#else
 #define INTERPOSE_BARRIERS 0
+#endif
 
 #define PASTER(x, y) real_##x##_##y
 #define EVALUATOR(x, y) PASTER(x, y)
@@ -84,14 +99,81 @@ extern int (*REAL(pthread_cond_signal))(pthread_cond_t *cond);
 extern int (*REAL(pthread_cond_broadcast))(pthread_cond_t *cond);
 #endif
 
+#if INTERPOSE_SEMAPHORE
+extern int (*REAL(sem_init))(sem_t *sem, int pshared, unsigned int value);
+extern int (*REAL(sem_destroy))(sem_t *sem);
+extern int (*REAL(sem_wait))(sem_t *sem);
+extern int (*REAL(sem_trywait))(sem_t *sem);
+extern int (*REAL(sem_timedwait))(sem_t *sem, const struct timespec *abstime);
+extern int (*REAL(sem_post))(sem_t *sem);
+extern int (*REAL(sem_getvalue))(sem_t *sem, int *value);
+#endif
+
+/*
+ * The mutex type is kept where glibc stores it (__kind), for the types set by
+ * static initializers (e.g. PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP) to be seen.
+ * Embedded locks must fit before it.
+ */
+#define MUTEX_KIND_OFFSET 16
+#define MUTEX_KIND_MASK 3 // Type bits of __kind, others are robust, PI, pshared... flags
+
+/*
+ * INTERPOSE_EMBEDDED: locks live in the pthread_mutex_t/pthread_rwlock_t
+ * storage itself instead of behind a malloc'ed pointer. Requires locks whose
+ * all-zero state is a valid unlocked lock, for static initializers to work.
+ */
+#ifdef INTERPOSE_EMBEDDED
+#ifndef LOCKIF_EMBEDDABLE
+#error "This lock cannot be embedded in pthread objects (padding or non zero-initializable)"
+#endif
+_Static_assert(sizeof(libslock_t) <= MUTEX_KIND_OFFSET, "Lock does not fit before the type of pthread_mutex_t");
+_Static_assert(sizeof(libslock_rwlock_t) <= sizeof(pthread_rwlock_t), "Rwlock does not fit in pthread_rwlock_t");
+#ifdef FLEXGUARD_PROFILE
+#error "Profiling needs mutexes to have an id in lock_as_t"
+#endif
+#endif
+
+#if INTERPOSE_SPINLOCK
+_Static_assert(sizeof(libslock_spinlock_t) <= sizeof(pthread_spinlock_t), "Compact lock does not fit in pthread_spinlock_t");
+#endif
+
 #define CAST_TO_LOCK(input) ((lock_as_t *)input)
 #define CAST_TO_COND(input) ((condvar_as_t *)input)
+#define CAST_TO_RWLOCK(input) ((rwlock_as_t *)input)
+#define CAST_TO_SEM(input) ((sem_as_t *)input)
 
 typedef struct lock_as_t
 {
-  volatile uint8_t status;
-  libslock_t *lock;
+  union
+  {
+#ifdef INTERPOSE_EMBEDDED
+    libslock_t lock;
+#else
+    struct
+    {
+      volatile uint8_t status;
+      libslock_t *lock;
+    };
+#endif
+    uint8_t header[MUTEX_KIND_OFFSET];
+  };
+  int type;
+  volatile int owner; // Owner of recursive and error-check mutexes, 0 if none
+  uint32_t count;     // Recursion count of the owner
+#ifdef FLEXGUARD_PROFILE
+  int profile_id;
+#endif
 } lock_as_t;
+_Static_assert(offsetof(lock_as_t, type) == offsetof(pthread_mutex_t, __data.__kind), "Mutex type not at __kind");
+_Static_assert(sizeof(lock_as_t) <= sizeof(pthread_mutex_t), "lock_as_t does not fit in pthread_mutex_t");
+
+#if INTERPOSE_RWLOCK
+typedef struct rwlock_as_t
+{
+  volatile uint8_t status;
+  libslock_rwlock_t *lock;
+} rwlock_as_t;
+#endif
 
 typedef struct condvar_as_t
 {
@@ -107,4 +189,21 @@ typedef struct barrier_as_t
 } barrier_as_t;
 #endif
 
+#if INTERPOSE_SEMAPHORE
+/*
+ * Only private semaphores of sem_init are replaced, and tagged in the last
+ * word of the sem_t (never written by glibc). Process-shared and sem_open
+ * semaphores are left to glibc, their waiters may be in other processes.
+ */
+#define SEM_TAG 0x666c657873656d00ULL
+
+typedef struct sem_as_t
+{
+  libslock_sem_t sem;
+  uint8_t unused[sizeof(sem_t) - sizeof(libslock_sem_t) - sizeof(uint64_t)];
+  uint64_t tag;
+} sem_as_t;
+_Static_assert(sizeof(sem_as_t) == sizeof(sem_t), "Semaphore does not fit in sem_t");
+#endif
+
 #endif // __INTERPOSE_H__
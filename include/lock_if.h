@@ -62,6 +62,8 @@
 #include "clh.h"
 #elif defined(USE_USCL_LOCKS)
 #include "uscl.h"
+#elif defined(USE_MULTI_LOCKS)
+#include "multi.h"
 
 #elif defined(USE_SHUFFLE_LOCKS) // LiTL locks
 #include "shuffle.h"
@@ -91,6 +93,33 @@ typedef LOCKIF_LOCK_T libslock_t;
     }
 #endif
 
+#ifdef LOCKIF_RWLOCK_T
+typedef LOCKIF_RWLOCK_T libslock_rwlock_t;
+#else
+typedef libslock_t libslock_rwlock_t; // Falls back to the exclusive lock
+#endif
+
+#ifdef LOCKIF_RWLOCK_INITIALIZER
+#define LIBSLOCK_RWLOCK_INITIALIZER LOCKIF_RWLOCK_INITIALIZER
+#else
+#define LIBSLOCK_RWLOCK_INITIALIZER LIBSLOCK_INITIALIZER
+#endif
+
+/*
+ * Compact locks fitting in a pthread_spinlock_t, only provided by some locks.
+ */
+#ifdef LOCKIF_SPINLOCK_T
+typedef LOCKIF_SPINLOCK_T libslock_spinlock_t;
+#define LIBSLOCK_SPINLOCK_INITIALIZER LOCKIF_SPINLOCK_INITIALIZER
+#endif
+
+/*
+ * Semaphores, only provided by some locks.
+ */
+#ifdef LOCKIF_SEM_T
+typedef LOCKIF_SEM_T libslock_sem_t;
+#endif
+
 #ifdef LOCKIF_COND_T
 typedef LOCKIF_COND_T libslock_cond_t;
 #else
@@ -129,11 +158,42 @@ typedef struct
  */
 
 static inline int libslock_init(libslock_t *lock);
+static inline int libslock_init_for(libslock_t *lock, void *object, void *caller, int type);
 static inline void libslock_destroy(libslock_t *lock);
 static inline void libslock_lock(libslock_t *lock);
 static inline int libslock_trylock(libslock_t *lock);
+static inline int libslock_timedlock(libslock_t *lock, const struct timespec *abstime);
 static inline void libslock_unlock(libslock_t *lock);
 
+static inline int libslock_rwlock_init(libslock_rwlock_t *lock);
+static inline int libslock_rwlock_init_for(libslock_rwlock_t *lock, void *object, void *caller);
+static inline void libslock_rwlock_destroy(libslock_rwlock_t *lock);
+static inline void libslock_rwlock_rdlock(libslock_rwlock_t *lock);
+static inline void libslock_rwlock_wrlock(libslock_rwlock_t *lock);
+static inline int libslock_rwlock_tryrdlock(libslock_rwlock_t *lock);
+static inline int libslock_rwlock_trywrlock(libslock_rwlock_t *lock);
+static inline int libslock_rwlock_timedrdlock(libslock_rwlock_t *lock, const struct timespec *abstime);
+static inline int libslock_rwlock_timedwrlock(libslock_rwlock_t *lock, const struct timespec *abstime);
+static inline void libslock_rwlock_unlock(libslock_rwlock_t *lock);
+
+#ifdef LOCKIF_SPINLOCK_T
+static inline int libslock_spin_init(libslock_spinlock_t *lock);
+static inline void libslock_spin_destroy(libslock_spinlock_t *lock);
+static inline void libslock_spin_lock(libslock_spinlock_t *lock);
+static inline int libslock_spin_trylock(libslock_spinlock_t *lock);
+static inline void libslock_spin_unlock(libslock_spinlock_t *lock);
+#endif
+
+#ifdef LOCKIF_SEM_T
+static inline int libslock_sem_init(libslock_sem_t *sem, int pshared, unsigned value);
+static inline int libslock_sem_destroy(libslock_sem_t *sem);
+static inline int libslock_sem_wait(libslock_sem_t *sem);
+static inline int libslock_sem_trywait(libslock_sem_t *sem);
+static inline int libslock_sem_timedwait(libslock_sem_t *sem, const struct timespec *abstime);
+static inline int libslock_sem_post(libslock_sem_t *sem);
+static inline int libslock_sem_getvalue(libslock_sem_t *sem, int *value);
+#endif
+
 static inline int libslock_cond_init(libslock_cond_t *cond);
 static inline int libslock_cond_destroy(libslock_cond_t *cond);
 static inline int libslock_cond_wait(libslock_cond_t *cond, libslock_t *lock);
@@ -158,6 +218,20 @@ static inline int libslock_init(libslock_t *lock)
     return LOCKIF_INIT(lock);
 }
 
+/*
+ * Initialize the lock of object (e.g. a pthread_mutex_t), created by caller.
+ * type is the pthread mutex type or -1. Only locks picking their
+ * implementation per lock make use of it.
+ */
+static inline int libslock_init_for(libslock_t *lock, void *object, void *caller, int type)
+{
+#ifdef LOCKIF_INIT_FOR
+    return LOCKIF_INIT_FOR(lock, object, caller, type);
+#else
+    return libslock_init(lock);
+#endif
+}
+
 static inline void libslock_destroy(libslock_t *lock)
 {
 #ifdef PAUSE_COUNTER
@@ -181,11 +255,190 @@ static inline int libslock_trylock(libslock_t *lock)
 #endif
 }
 
+static inline int libslock_timedlock(libslock_t *lock, const struct timespec *abstime)
+{
+#ifdef LOCKIF_TIMEDLOCK
+    return LOCKIF_TIMEDLOCK(lock, abstime);
+#else
+    fprintf(stderr, "Timed locks not supported by this lock.\n");
+    exit(EXIT_FAILURE);
+#endif
+}
+
 static inline void libslock_unlock(libslock_t *lock)
 {
     LOCKIF_UNLOCK(lock);
 }
 
+/*
+ *  Reader-Writer Lock Functions
+ *  Locks without a reader-writer implementation use their exclusive lock.
+ */
+
+static inline int libslock_rwlock_init(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_INIT
+    return LOCKIF_RWLOCK_INIT(lock);
+#else
+    return libslock_init(lock);
+#endif
+}
+
+static inline int libslock_rwlock_init_for(libslock_rwlock_t *lock, void *object, void *caller)
+{
+#ifdef LOCKIF_RWLOCK_INIT_FOR
+    return LOCKIF_RWLOCK_INIT_FOR(lock, object, caller);
+#elif defined(LOCKIF_RWLOCK_INIT)
+    return LOCKIF_RWLOCK_INIT(lock);
+#else
+    return libslock_init_for(lock, object, caller, -1);
+#endif
+}
+
+static inline void libslock_rwlock_destroy(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_DESTROY
+    LOCKIF_RWLOCK_DESTROY(lock);
+#else
+    libslock_destroy(lock);
+#endif
+}
+
+static inline void libslock_rwlock_rdlock(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_RDLOCK
+    LOCKIF_RWLOCK_RDLOCK(lock);
+#else
+    libslock_lock(lock);
+#endif
+}
+
+static inline void libslock_rwlock_wrlock(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_WRLOCK
+    LOCKIF_RWLOCK_WRLOCK(lock);
+#else
+    libslock_lock(lock);
+#endif
+}
+
+static inline int libslock_rwlock_tryrdlock(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_TRYRDLOCK
+    return LOCKIF_RWLOCK_TRYRDLOCK(lock);
+#else
+    return libslock_trylock(lock);
+#endif
+}
+
+static inline int libslock_rwlock_trywrlock(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_TRYWRLOCK
+    return LOCKIF_RWLOCK_TRYWRLOCK(lock);
+#else
+    return libslock_trylock(lock);
+#endif
+}
+
+static inline int libslock_rwlock_timedrdlock(libslock_rwlock_t *lock, const struct timespec *abstime)
+{
+#ifdef LOCKIF_RWLOCK_TIMEDRDLOCK
+    return LOCKIF_RWLOCK_TIMEDRDLOCK(lock, abstime);
+#else
+    return libslock_timedlock(lock, abstime);
+#endif
+}
+
+static inline int libslock_rwlock_timedwrlock(libslock_rwlock_t *lock, const struct timespec *abstime)
+{
+#ifdef LOCKIF_RWLOCK_TIMEDWRLOCK
+    return LOCKIF_RWLOCK_TIMEDWRLOCK(lock, abstime);
+#else
+    return libslock_timedlock(lock, abstime);
+#endif
+}
+
+static inline void libslock_rwlock_unlock(libslock_rwlock_t *lock)
+{
+#ifdef LOCKIF_RWLOCK_UNLOCK
+    LOCKIF_RWLOCK_UNLOCK(lock);
+#else
+    libslock_unlock(lock);
+#endif
+}
+
+/*
+ *  Compact Lock Functions
+ */
+
+#ifdef LOCKIF_SPINLOCK_T
+static inline int libslock_spin_init(libslock_spinlock_t *lock)
+{
+    return LOCKIF_SPIN_INIT(lock);
+}
+
+static inline void libslock_spin_destroy(libslock_spinlock_t *lock)
+{
+    LOCKIF_SPIN_DESTROY(lock);
+}
+
+static inline void libslock_spin_lock(libslock_spinlock_t *lock)
+{
+    LOCKIF_SPIN_LOCK(lock);
+}
+
+static inline int libslock_spin_trylock(libslock_spinlock_t *lock)
+{
+    return LOCKIF_SPIN_TRYLOCK(lock);
+}
+
+static inline void libslock_spin_unlock(libslock_spinlock_t *lock)
+{
+    LOCKIF_SPIN_UNLOCK(lock);
+}
+#endif
+
+/*
+ *  Semaphore Functions
+ */
+
+#ifdef LOCKIF_SEM_T
+static inline int libslock_sem_init(libslock_sem_t *sem, int pshared, unsigned value)
+{
+    return LOCKIF_SEM_INIT(sem, pshared, value);
+}
+
+static inline int libslock_sem_destroy(libslock_sem_t *sem)
+{
+    return LOCKIF_SEM_DESTROY(sem);
+}
+
+static inline int libslock_sem_wait(libslock_sem_t *sem)
+{
+    return LOCKIF_SEM_WAIT(sem);
+}
+
+static inline int libslock_sem_trywait(libslock_sem_t *sem)
+{
+    return LOCKIF_SEM_TRYWAIT(sem);
+}
+
+static inline int libslock_sem_timedwait(libslock_sem_t *sem, const struct timespec *abstime)
+{
+    return LOCKIF_SEM_TIMEDWAIT(sem, abstime);
+}
+
+static inline int libslock_sem_post(libslock_sem_t *sem)
+{
+    return LOCKIF_SEM_POST(sem);
+}
+
+static inline int libslock_sem_getvalue(libslock_sem_t *sem, int *value)
+{
+    return LOCKIF_SEM_GETVALUE(sem, value);
+}
+#endif
+
 /*
  *  Condition Variables Functions
  */
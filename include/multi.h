@@ -0,0 +1,233 @@
+/*
+ * File: multi.h
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      All locks in a single library, picked per lock at run time
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _MULTI_H_
+#define _MULTI_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "atomic_ops.h"
+#include "utils.h"
+#include "multi_size.h" // Generated by the Makefile from MULTI_LOCKS
+
+/*
+ * Each lock of MULTI_LOCKS is compiled into its own ops table (multi_ops.c).
+ * Locks are bound to a table when initialized, following these rules:
+ *
+ *   MULTI_LOCK="futex,flexguard@caller=db_bench+0x4a000-0x4b000,mcs@type=adaptive"
+ *   MULTI_LOCK_CONFIG=/path/to/rules (one rule per line, # comments)
+ *
+ *   <lock>                       Default lock (first of MULTI_LOCKS otherwise)
+ *   <lock>@caller=<range>        Locks initialized from code in range
+ *   <lock>@addr=<range>          Locks stored in range
+ *   <lock>@type=<type>           Mutexes of a type (normal, recursive, errorcheck, adaptive)
+ *
+ * A range is [<object>+]<start>-<end>, relative to the load address of a
+ * shared object or the executable when prefixed by its file name.
+ * First matching rule wins.
+ */
+
+typedef struct multi_ops_t
+{
+  const char *name;
+
+  int (*init)(void *lock);
+  void (*destroy)(void *lock);
+  void (*lock)(void *lock);
+  int (*trylock)(void *lock);
+  int (*timedlock)(void *lock, const struct timespec *abstime);
+  void (*unlock)(void *lock);
+
+  int (*rwlock_init)(void *lock);
+  void (*rwlock_destroy)(void *lock);
+  void (*rwlock_rdlock)(void *lock);
+  void (*rwlock_wrlock)(void *lock);
+  int (*rwlock_tryrdlock)(void *lock);
+  int (*rwlock_trywrlock)(void *lock);
+  int (*rwlock_timedrdlock)(void *lock, const struct timespec *abstime);
+  int (*rwlock_timedwrlock)(void *lock, const struct timespec *abstime);
+  void (*rwlock_unlock)(void *lock);
+
+  int (*cond_init)(void *cond);
+  int (*cond_destroy)(void *cond);
+  int (*cond_wait)(void *cond, void *lock);
+  int (*cond_timedwait)(void *cond, void *lock, const struct timespec *abstime);
+  int (*cond_signal)(void *cond);
+  int (*cond_broadcast)(void *cond);
+} multi_ops_t;
+
+/*
+ * The selected lock is stored inline, sized for the largest lock of
+ * MULTI_LOCKS, so that locking costs no more loads than a static build.
+ */
+typedef struct multi_lock_t
+{
+  uint8_t lock[MULTI_LOCK_SIZE] __attribute__((aligned(MULTI_ALIGN)));
+  const multi_ops_t *ops;
+} multi_lock_t;
+#define MULTI_INITIALIZER {{0}, NULL}
+
+typedef struct multi_rwlock_t
+{
+  uint8_t lock[MULTI_RWLOCK_SIZE] __attribute__((aligned(MULTI_ALIGN)));
+  const multi_ops_t *ops;
+} multi_rwlock_t;
+
+/*
+ * Condition variables take the ops of the first lock they wait with, so that
+ * each lock keeps its own condition variables (and their blocking policy).
+ */
+typedef struct multi_cond_t
+{
+  uint8_t cond[MULTI_COND_SIZE] __attribute__((aligned(MULTI_ALIGN)));
+  const multi_ops_t *ops;
+} multi_cond_t;
+#define MULTI_COND_INITIALIZER {{0}, NULL}
+
+/*
+ * Declarations
+ */
+const multi_ops_t *multi_ops_by_name(const char *name);
+const multi_ops_t *multi_select(void *object, void *caller, int type);
+
+int multi_init(multi_lock_t *the_lock);
+int multi_init_for(multi_lock_t *the_lock, void *object, void *caller, int type);
+void multi_destroy(multi_lock_t *the_lock);
+
+int multi_rwlock_init(multi_rwlock_t *the_lock);
+int multi_rwlock_init_for(multi_rwlock_t *the_lock, void *object, void *caller);
+void multi_rwlock_destroy(multi_rwlock_t *the_lock);
+
+int multi_cond_init(multi_cond_t *cond);
+int multi_cond_wait(multi_cond_t *cond, multi_lock_t *the_lock);
+int multi_cond_timedwait(multi_cond_t *cond, multi_lock_t *the_lock, const struct timespec *ts);
+int multi_cond_signal(multi_cond_t *cond);
+int multi_cond_broadcast(multi_cond_t *cond);
+int multi_cond_destroy(multi_cond_t *cond);
+
+/*
+ * Dispatch, inlined so that the only cost over a static build is the indirect call.
+ */
+static inline void multi_lock(multi_lock_t *the_lock)
+{
+  the_lock->ops->lock(the_lock->lock);
+}
+
+static inline int multi_trylock(multi_lock_t *the_lock)
+{
+  return the_lock->ops->trylock(the_lock->lock);
+}
+
+static inline int multi_timedlock(multi_lock_t *the_lock, const struct timespec *abstime)
+{
+  return the_lock->ops->timedlock(the_lock->lock, abstime);
+}
+
+static inline void multi_unlock(multi_lock_t *the_lock)
+{
+  the_lock->ops->unlock(the_lock->lock);
+}
+
+static inline void multi_rwlock_rdlock(multi_rwlock_t *the_lock)
+{
+  the_lock->ops->rwlock_rdlock(the_lock->lock);
+}
+
+static inline void multi_rwlock_wrlock(multi_rwlock_t *the_lock)
+{
+  the_lock->ops->rwlock_wrlock(the_lock->lock);
+}
+
+static inline int multi_rwlock_tryrdlock(multi_rwlock_t *the_lock)
+{
+  return the_lock->ops->rwlock_tryrdlock(the_lock->lock);
+}
+
+static inline int multi_rwlock_trywrlock(multi_rwlock_t *the_lock)
+{
+  return the_lock->ops->rwlock_trywrlock(the_lock->lock);
+}
+
+static inline int multi_rwlock_timedrdlock(multi_rwlock_t *the_lock, const struct timespec *abstime)
+{
+  return the_lock->ops->rwlock_timedrdlock(the_lock->lock, abstime);
+}
+
+static inline int multi_rwlock_timedwrlock(multi_rwlock_t *the_lock, const struct timespec *abstime)
+{
+  return the_lock->ops->rwlock_timedwrlock(the_lock->lock, abstime);
+}
+
+static inline void multi_rwlock_unlock(multi_rwlock_t *the_lock)
+{
+  the_lock->ops->rwlock_unlock(the_lock->lock);
+}
+
+/*
+ * lock_if.h bindings, not for the ops tables which bind the lock they wrap
+ */
+#ifndef MULTI_OPS
+
+#define LOCKIF_LOCK_T multi_lock_t
+#define LOCKIF_INIT multi_init
+#define LOCKIF_INIT_FOR multi_init_for
+#define LOCKIF_DESTROY multi_destroy
+#define LOCKIF_LOCK multi_lock
+#define LOCKIF_TRYLOCK multi_trylock
+#define LOCKIF_TIMEDLOCK multi_timedlock
+#define LOCKIF_UNLOCK multi_unlock
+#define LOCKIF_INITIALIZER MULTI_INITIALIZER
+
+#define LOCKIF_RWLOCK_T multi_rwlock_t
+#define LOCKIF_RWLOCK_INIT multi_rwlock_init
+#define LOCKIF_RWLOCK_INIT_FOR multi_rwlock_init_for
+#define LOCKIF_RWLOCK_DESTROY multi_rwlock_destroy
+#define LOCKIF_RWLOCK_RDLOCK multi_rwlock_rdlock
+#define LOCKIF_RWLOCK_WRLOCK multi_rwlock_wrlock
+#define LOCKIF_RWLOCK_TRYRDLOCK multi_rwlock_tryrdlock
+#define LOCKIF_RWLOCK_TRYWRLOCK multi_rwlock_trywrlock
+#define LOCKIF_RWLOCK_TIMEDRDLOCK multi_rwlock_timedrdlock
+#define LOCKIF_RWLOCK_TIMEDWRLOCK multi_rwlock_timedwrlock
+#define LOCKIF_RWLOCK_UNLOCK multi_rwlock_unlock
+#define LOCKIF_RWLOCK_INITIALIZER MULTI_INITIALIZER
+
+#define LOCKIF_COND_T multi_cond_t
+#define LOCKIF_COND_INIT multi_cond_init
+#define LOCKIF_COND_DESTROY multi_cond_destroy
+#define LOCKIF_COND_WAIT multi_cond_wait
+#define LOCKIF_COND_TIMEDWAIT multi_cond_timedwait
+#define LOCKIF_COND_SIGNAL multi_cond_signal
+#define LOCKIF_COND_BROADCAST multi_cond_broadcast
+#define LOCKIF_COND_INITIALIZER MULTI_COND_INITIALIZER
+#endif
+
+#endif
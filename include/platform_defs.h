@@ -50,6 +50,25 @@ extern "C"
  */
 #define MAX_NUMBER_LOCKS 1000
 
+/*
+ * Maximum number of threads and live locks of the locks keeping their tables
+ * in a BPF arena (flexguard, hybridlock). Only the pages in use are allocated.
+ */
+#define MAX_ARENA_THREADS 65536
+#define MAX_ARENA_LOCKS 262144
+
+/*
+ * Maximum number of live processes forked from a flexguard process
+ * sharing its BPF program, each with its own arena tables.
+ */
+#define FLEXGUARD_MAX_PROCESSES 64
+
+/*
+ * Arena tables start after the first page and leave the last one free,
+ * where libbpf may place global arena variables.
+ */
+#define ARENA_PAGE_SIZE 4096
+
 #ifdef __cplusplus
 }
 #endif
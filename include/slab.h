@@ -0,0 +1,87 @@
+/*
+ * File: slab.h
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      Per-thread slab allocator of cache-line-aligned objects
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+/*
+ * Objects are carved out of slabs of slab_size bytes, aligned on slab_size so
+ * that the slab header is found from any object. Each thread allocates from
+ * slabs it owns, first touched by itself and thus local to its NUMA node.
+ * Objects freed by other threads are pushed to the owner's remote list
+ * without locking. Slabs of exited threads are handed over to new threads.
+ */
+#define SLAB_MIN_SIZE (64 * 1024)
+#define SLAB_MIN_OBJECTS 16
+#define SLAB_MAX_CACHES 8
+
+typedef struct slab_object_t
+{
+  struct slab_object_t *next;
+} slab_object_t;
+
+typedef struct slab_thread_t
+{
+  union
+  {
+    slab_object_t *free; // Owner only
+    uint8_t padding1[CACHE_LINE_SIZE];
+  };
+  union
+  {
+    slab_object_t *volatile remote_free;
+    uint8_t padding2[CACHE_LINE_SIZE];
+  };
+  struct slab_thread_t *next_orphan;
+} slab_thread_t;
+
+typedef struct slab_cache_t
+{
+  size_t object_size;
+  size_t slab_size;
+  int index;
+  volatile uint8_t status;
+
+  slab_thread_t *orphans;
+  volatile uint8_t orphans_lock;
+} slab_cache_t;
+#define SLAB_CACHE_INITIALIZER(size) {.object_size = (size)}
+
+/*
+ * Declarations
+ */
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *object);
+
+#endif
@@ -38,6 +38,8 @@
 #include <sched.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <limits.h>
 #include <emmintrin.h>
@@ -69,6 +71,23 @@ extern "C"
     } while (0)
 #else
 #define PAUSE RAW_PAUSE
+#endif
+
+#ifdef FLEXGUARD_PROFILE
+    /*
+     * Slow-path events of the lock calls of the current thread.
+     * Read before and after each call to attribute them to a lock.
+     */
+    typedef struct
+    {
+        uint64_t slow_paths;
+        uint64_t sleeps;
+    } lock_events_t;
+    extern __thread lock_events_t lock_events __attribute__((tls_model("initial-exec")));
+
+#define LOCK_EVENT(name) (lock_events.name++)
+#else
+#define LOCK_EVENT(name)
 #endif
 
     static inline void pause_rep(uint32_t num_reps)
@@ -168,6 +187,25 @@ init = 2;
         return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0); /* Wait if *addr == val. */
     }
 
+    /*
+     * FUTEX_WAIT_BITSET_PRIVATE syscall with an absolute CLOCK_REALTIME timeout,
+     * as used by pthread timed functions. Fails with ETIMEDOUT once abstime has passed.
+     */
+    static inline long futex_wait_until(void *addr, int val, const struct timespec *abstime)
+    {
+        return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, val, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+    }
+
+    /*
+     * Whether the CLOCK_REALTIME deadline abstime has passed.
+     */
+    static inline int deadline_passed(const struct timespec *abstime)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec > abstime->tv_sec || (now.tv_sec == abstime->tv_sec && now.tv_nsec >= abstime->tv_nsec);
+    }
+
     /*
      * FUTEX_WAKE_PRIVATE syscall.
      * addr: Address waiters are waiting on.
@@ -178,6 +216,16 @@ init = 2;
         return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nb_threads, NULL, NULL, 0);
     }
 
+    /*
+     * FUTEX_CMP_REQUEUE_PRIVATE syscall.
+     * Wakes nb_wake threads waiting on addr and moves up to nb_requeue others
+     * to addr2 if addr still points to val, fails with EAGAIN otherwise.
+     */
+    static inline long futex_cmp_requeue(void *addr, int val, int nb_wake, int nb_requeue, void *addr2)
+    {
+        return syscall(SYS_futex, addr, FUTEX_CMP_REQUEUE_PRIVATE, nb_wake, (void *)(long)nb_requeue, addr2, val);
+    }
+
 // debugging functions
 #ifdef DEBUG
 #define DPRINT(...) fprintf(stderr, __VA_ARGS__);
@@ -210,6 +258,27 @@ init = 2;
         exit(EXIT_FAILURE);                                                                     \
     }
 
+#define CHECK_NUMBER_ARENA_THREADS_FATAL(nb_thread)                                            \
+    if (nb_thread >= MAX_ARENA_THREADS)                                                        \
+    {                                                                                          \
+        fprintf(stderr, "Too many threads. Increase MAX_ARENA_THREADS in platform_defs.h.\n"); \
+        exit(EXIT_FAILURE);                                                                    \
+    }
+
+/*
+ * Reserve zeroed memory whose pages are only allocated when first touched.
+ */
+static inline void *alloc_on_demand(size_t size)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return addr;
+}
+
 #define UNLIKELY(...) __glibc_unlikely(__VA_ARGS__)
 #define LIKELY(...) __glibc_likely(__VA_ARGS__)
 
@@ -92,6 +92,13 @@ compile_and_suffix "usclnopad" "LOCK_VERSION=USCL ADD_PADDING=0"
 compile_and_suffix "flexguardnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0"
 compile_and_suffix "flexguardallnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 FLEXGUARD_ALL=1"
 compile_and_suffix "flexguardextendnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 TIMESLICE_EXTENSION=1"
+compile_and_suffix "flexguardscxextendnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 TIMESLICE_EXTENSION=SCX"
+compile_and_suffix "flexguardscxyieldnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 FLEXGUARD_SCX_YIELD=1"
+compile_and_suffix "flexguardnumanopad" "LOCK_VERSION=FLEXGUARDNUMA ADD_PADDING=0"
+compile_and_suffix "flexguardclhnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 HYBRID_VERSION=CLH"
+compile_and_suffix "flexguardticketnopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 HYBRID_VERSION=TICKET"
+compile_and_suffix "flexguardembeddednopad" "LOCK_VERSION=FLEXGUARD ADD_PADDING=0 INTERPOSE_EMBEDDED=1"
+compile_and_suffix "multinopad" "LOCK_VERSION=MULTI ADD_PADDING=0"
 
 compile_and_suffix "mcstas" "LOCK_VERSION=MCSTAS ADD_PADDING=1"
 compile_and_suffix "mcstasextend" "LOCK_VERSION=MCSTAS ADD_PADDING=1 TIMESLICE_EXTENSION=1"
@@ -111,6 +118,12 @@ compile_and_suffix "uscl" "LOCK_VERSION=USCL ADD_PADDING=1"
 compile_and_suffix "flexguard" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1"
 compile_and_suffix "flexguardall" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1 FLEXGUARD_ALL=1"
 compile_and_suffix "flexguardextend" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1 TIMESLICE_EXTENSION=1"
+compile_and_suffix "flexguardscxextend" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1 TIMESLICE_EXTENSION=SCX"
+compile_and_suffix "flexguardscxyield" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1 FLEXGUARD_SCX_YIELD=1"
+compile_and_suffix "flexguardnuma" "LOCK_VERSION=FLEXGUARDNUMA ADD_PADDING=1"
+compile_and_suffix "flexguardclh" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1 HYBRID_VERSION=CLH"
+compile_and_suffix "flexguardticket" "LOCK_VERSION=FLEXGUARD ADD_PADDING=1 HYBRID_VERSION=TICKET"
+compile_and_suffix "multi" "LOCK_VERSION=MULTI ADD_PADDING=1"
 
 make clean >/dev/null
 
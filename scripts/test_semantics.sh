@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Usage: scripts/test_semantics.sh [LOCK_VERSION...] (default: FLEXGUARD)
+
+for lock in ${@:-FLEXGUARD}; do
+    echo "############### $lock"
+    make clean >/dev/null
+    make -j40 all LOCK_VERSION=$lock >/dev/null || exit 1
+    make test_semantics >/dev/null
+    ./interpose.sh ./test_semantics || exit 1
+done
@@ -47,6 +47,68 @@
 #define TASK_NOLOAD 0x00000400
 #define TASK_NEW 0x00000800
 
+/*
+ * Task local storage (Linux 5.11) is missing from the bundled 5.8 vmlinux.h.
+ */
+#define MAP_TYPE_TASK_STORAGE 29
+#define LOCAL_STORAGE_GET_F_CREATE 1
+
+/*
+ * BPF arenas (Linux 6.9) are missing from the bundled 5.8 vmlinux.h.
+ * Referencing an __arena_global variable associates the program with the arena.
+ */
+#define MAP_TYPE_ARENA 33
+#define __arena __attribute__((address_space(1)))
+#define __arena_global __attribute__((address_space(1)))
+#define ARENA_PAGES(size) (((size) + ARENA_PAGE_SIZE - 1) / ARENA_PAGE_SIZE + 1) // Last page left free
+
+/*
+ * sched_ext (Linux 6.12) is missing from the bundled 5.8 vmlinux.h.
+ * Only the members used are declared, libbpf matches them by name.
+ */
+struct sched_ext_ops
+{
+  s32 (*init)(void);
+  void (*enqueue)(struct task_struct *p, u64 enq_flags);
+  void (*dispatch)(s32 cpu, struct task_struct *prev);
+  void (*tick)(struct task_struct *p);
+  u64 flags;
+  char name[128];
+};
+
+#define SCX_OPS_SWITCH_PARTIAL (1ULL << 3) // Only tasks set to SCHED_EXT
+
+#define SCX_SLICE_DFL (20ULL * 1000 * 1000)
+
+/*
+ * Dispatch kfuncs, renamed in Linux 6.13. The names of 6.12 are flavors
+ * resolved by libbpf when the new ones do not exist.
+ */
+s32 scx_bpf_create_dsq(u64 dsq_id, s32 node) __ksym;
+void scx_bpf_dsq_insert(struct task_struct *p, u64 dsq_id, u64 slice, u64 enq_flags) __ksym __weak;
+void scx_bpf_dispatch___compat(struct task_struct *p, u64 dsq_id, u64 slice, u64 enq_flags) __ksym __weak;
+bool scx_bpf_dsq_move_to_local(u64 dsq_id) __ksym __weak;
+bool scx_bpf_consume___compat(u64 dsq_id) __ksym __weak;
+
+#define scx_bpf_dsq_insert(p, dsq_id, slice, enq_flags)                  \
+  (bpf_ksym_exists(scx_bpf_dsq_insert)                                   \
+       ? scx_bpf_dsq_insert((p), (dsq_id), (slice), (enq_flags))         \
+       : scx_bpf_dispatch___compat((p), (dsq_id), (slice), (enq_flags)))
+#define scx_bpf_dsq_move_to_local(dsq_id)   \
+  (bpf_ksym_exists(scx_bpf_dsq_move_to_local) \
+       ? scx_bpf_dsq_move_to_local(dsq_id)    \
+       : scx_bpf_consume___compat(dsq_id))
+
+struct sched_ext_entity
+{
+  u64 slice;
+} __attribute__((preserve_access_index));
+
+struct task_struct___scx
+{
+  struct sched_ext_entity scx;
+} __attribute__((preserve_access_index));
+
 struct task_struct___o
 {
   volatile long int state;
@@ -65,4 +127,23 @@ static __always_inline __s64 get_task_state(void *task)
     return BPF_CORE_READ(t, __state);
   return BPF_CORE_READ((struct task_struct___o *)task, state);
 }
+
+/*
+ * CFS bandwidth control (CONFIG_CFS_BANDWIDTH) is disabled in the bundled
+ * vmlinux.h. throttle_count is non-zero while the cfs_rq or one of its
+ * ancestors is throttled by its cpu.max quota.
+ */
+struct cfs_rq___bw
+{
+  int throttle_count;
+} __attribute__((preserve_access_index));
+
+static __always_inline int task_throttled(struct task_struct *task)
+{
+  struct cfs_rq___bw *cfs_rq = (void *)BPF_CORE_READ(task, se.cfs_rq);
+
+  if (!cfs_rq || !bpf_core_field_exists(cfs_rq->throttle_count))
+    return 0;
+  return BPF_CORE_READ(cfs_rq, throttle_count) > 0;
+}
 #endif
\ No newline at end of file
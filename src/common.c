@@ -1,3 +1,9 @@
+#include "utils.h"
+
 #ifdef PAUSE_COUNTER
 long pause_counter = 0;
+#endif
+
+#ifdef FLEXGUARD_PROFILE
+__thread lock_events_t lock_events;
 #endif
\ No newline at end of file
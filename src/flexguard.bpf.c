@@ -30,12 +30,11 @@
 
 #include "vmlinux.h"
 #include "platform_defs.h"
-#include "flexguard_bpf.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
-#include <asm/processor-flags.h>
 #include "bpf_fixes.bpf.h"
+#include "flexguard_bpf.h"
 
 #ifdef DEBUG
 #define DPRINT(args...) bpf_printk(args);
@@ -43,122 +42,428 @@
 #define DPRINT(...)
 #endif
 
-#define MAX_STACK_TRACE_DEPTH 8
-
-hybrid_addresses_t addresses;
-flexguard_qnode_t qnodes[MAX_NUMBER_THREADS];
+struct
+{
+	__uint(type, MAP_TYPE_ARENA);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(max_entries, ARENA_PAGES(FLEXGUARD_ARENA_SIZE));
+} arena SEC(".maps");
 
-num_preempted_cs_t num_preempted_cs = 0;
+// Filled by user space with the arena tables once the arena is mapped.
+flexguard_process_t __arena *__arena_global processes;
 
 char _license[4] SEC("license") = "GPL";
 
-struct
+/*
+ * Kernel tgid of the process using the locks, set on the first registration.
+ * Switches of other processes are filtered out before any map access,
+ * unless forked children registered threads too.
+ */
+int flexguard_tgid = 0;
+int flexguard_forked = 0;
+
+static __always_inline int is_flexguard_task(struct task_struct *task)
 {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, u32);
-	__type(value, int);
-	__uint(max_entries, MAX_NUMBER_THREADS);
-} nodes_map SEC(".maps");
+	return !(task->flags & 0x00200000) && (task->tgid == flexguard_tgid || flexguard_forked); // PF_KTHREAD
+}
 
 struct
 {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, u32);
-	__type(value, u32);
-	__uint(max_entries, MAX_NUMBER_THREADS);
-} is_preempted_map SEC(".maps");
+	__uint(type, MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, flexguard_task_t);
+} task_map SEC(".maps");
 
 /*
  * Will return 1 if the thread is detected as a critical thread.
- * A critical thread holds the MCS or TAS lock.
+ * A critical thread holds the queue or the TAS lock.
  */
-static int is_critical_thread(struct task_struct *task, flexguard_qnode_ptr qnode)
+static int is_critical_thread(flexguard_qnode_ptr qnode)
 {
-	u64 user_stack[MAX_STACK_TRACE_DEPTH];
-	long user_stack_size = bpf_get_task_stack(task, user_stack, MAX_STACK_TRACE_DEPTH * sizeof(u64), BPF_F_USER_STACK);
-	if (user_stack_size <= 0)
+	switch (qnode->phase)
 	{
-		bpf_printk("Error getting stack (%ld).", user_stack_size);
+	case FLEXGUARD_PHASE_FASTPATH:
 		return 0;
-	}
-
-	if ((u64)addresses.lock <= user_stack[0] && user_stack[0] < (u64)addresses.fastpath)
+	case FLEXGUARD_PHASE_ENQUEUED:
 	{
-		return 0; // Not critical before fastpath.
+#ifdef HYBRID_TICKET
+		// The calling counter lives in the lock, in user memory.
+		u32 calling;
+		if (bpf_probe_read_user(&calling, sizeof(calling), (const void *)qnode->calling))
+			return 1;
+		return (s32)(qnode->ticket - calling) <= 0;
+#elif defined(HYBRID_CLH)
+		// The predecessor's node may be the initial node of the lock, outside the arena.
+		u8 done;
+		if (bpf_probe_read_user(&done, sizeof(done), (const void *)&qnode->pred->done))
+			return 1;
+		return done != 0;
+#else
+		return qnode->waiting == 0;
+#endif
 	}
-
-	if ((u64)addresses.fastpath_out <= user_stack[0] && user_stack[0] < (u64)addresses.lock_check_rcx_null)
-	{
-		return 0; // Not critical before enqueue.
+	default:
+		return 1;
 	}
+}
 
-	if ((u64)addresses.lock_check_rcx_null <= user_stack[0] && user_stack[0] < (u64)addresses.phase2)
+/*
+ * Add delta to the preempted holder count of every lock held by the thread.
+ * The qnode cannot change while the thread is off-cpu, so the same locks
+ * are found when it is scheduled back in.
+ */
+static void account_held_locks(flexguard_process_t __arena *process, flexguard_qnode_ptr qnode, u32 flags, int delta)
+{
+	int i, n = qnode->cs_counter;
+	u32 id;
+
+	if (!(flags & PREEMPTED_CS))
+		n--; // Lock being acquired was not reached yet
+
+	for (i = 0; i < FLEXGUARD_MAX_NESTED_LOCKS && i < n; i++)
 	{
-		struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(task);
-
-		/*
-		 * Critical preemption in waiting phase1 iff:
-		 * - rcx is NULL (lock was free)
-		 * - or if the thread is not waiting anymore (waiting == 0).
-		 */
-		return (void *)regs->cx == NULL || qnode->waiting == 0;
+		id = qnode->held_locks[i];
+		if (id < MAX_ARENA_LOCKS)
+			__sync_fetch_and_add(&process->lock_preempted_cs[id].count, delta);
 	}
 
-	if ((u64)addresses.fastpath <= user_stack[0] && user_stack[0] < (u64)addresses.fastpath_out)
-	{
-		struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(task);
+	if (flags & (PREEMPTED_CS | PREEMPTED_NESTED))
+		__sync_fetch_and_add(&process->num_preempted_cs, delta);
+}
 
-		/*
-		 * Critical preemption in Fastpath iff:
-		 * - CAS succeeded (rax != 0).
-		 */
-		return ((int)regs->ax) != 0;
-	}
+/*
+ * Flags of a thread that is runnable but not running.
+ */
+static u32 runnable_flags(flexguard_qnode_ptr qnode)
+{
+	u32 flags = PREEMPTED_RUNNABLE; // More runnable threads than cpus
+
+	if (qnode->cs_counter > 1)
+		flags |= PREEMPTED_NESTED;
+	if (qnode->cs_counter && is_critical_thread(qnode))
+		flags |= PREEMPTED_CS;
 
-	return 1;
+	/*
+	 * Read-side critical sections are counted separately so that
+	 * readers keep sharing the lock while writers block.
+	 */
+	if (qnode->rcs_counter)
+		flags |= PREEMPTED_READER;
+	return flags;
+}
+
+static void account_preemption(flexguard_process_t __arena *process, flexguard_qnode_ptr qnode, u32 flags, int delta)
+{
+	if (flags & PREEMPTED_WAITER)
+		qnode->descheduled = delta > 0;
+	if (flags & (PREEMPTED_CS | PREEMPTED_NESTED))
+		account_held_locks(process, qnode, flags, delta);
+	if (flags & PREEMPTED_READER)
+		__sync_fetch_and_add(&process->num_preempted_readers, delta);
+	if (flags & PREEMPTED_RUNNABLE)
+		__sync_fetch_and_add(&process->num_preempted_threads, delta);
+}
+
+/*
+ * Flags of a thread going to sleep (I/O, page fault, nested lock...) while
+ * holding locks. They are accounted as a preemption if its previous sleeps in
+ * critical sections were long enough, see FLEXGUARD_SLEEP_BLOCK_NS.
+ */
+static u32 sleeping_holder_flags(flexguard_task_t *t, flexguard_qnode_ptr qnode)
+{
+	u32 flags = 0;
+
+	if (qnode->cs_counter > 1)
+		flags |= PREEMPTED_NESTED;
+	if (qnode->cs_counter && qnode->phase == FLEXGUARD_PHASE_HOLDING)
+		flags |= PREEMPTED_CS; // Not a waiter sleeping for the lock
+	if (qnode->rcs_counter)
+		flags |= PREEMPTED_READER;
+	if (!flags)
+		return 0;
+
+	t->sleep_start = bpf_ktime_get_ns();
+	return PREEMPTED_SLEEPING | (t->sleep_blocking ? flags : 0);
+}
+
+static void update_sleep_average(flexguard_task_t *t)
+{
+	u64 duration = bpf_ktime_get_ns() - t->sleep_start;
+
+	t->sleep_average = t->sleep_average - (t->sleep_average >> 3) + (duration >> 3);
+	if (t->sleep_average >= FLEXGUARD_SLEEP_BLOCK_NS)
+		t->sleep_blocking = 1;
+	else if (t->sleep_average < FLEXGUARD_SLEEP_SPIN_NS)
+		t->sleep_blocking = 0;
+}
+
+/*
+ * Run by each thread through BPF_PROG_RUN, in its own task context,
+ * to attach its qnode to its task storage.
+ */
+SEC("syscall")
+int register_thread(flexguard_register_args_t *args)
+{
+	struct task_struct *task = bpf_get_current_task_btf();
+	flexguard_task_t *t;
+	int thread_id = args->thread_id;
+
+	if (thread_id < 0 || thread_id >= MAX_ARENA_THREADS || args->process < 0 || args->process >= FLEXGUARD_MAX_PROCESSES)
+		return 1;
+
+	t = bpf_task_storage_get(&task_map, task, NULL, LOCAL_STORAGE_GET_F_CREATE);
+	if (!t)
+		return 1;
+
+	t->process = args->process;
+	t->thread_id = thread_id;
+	t->preempted = 0;
+	t->sleep_blocking = 0;
+	t->sleep_average = 0;
+
+	if (!flexguard_tgid)
+		flexguard_tgid = task->tgid;
+	else if (flexguard_tgid != task->tgid)
+		flexguard_forked = 1;
+	return 0;
+}
+
+/*
+ * Run by exiting threads before their qnode is reused by another thread.
+ */
+SEC("syscall")
+int unregister_thread(void *args)
+{
+	bpf_task_storage_delete(&task_map, bpf_get_current_task_btf());
+	return 0;
 }
 
 SEC("tp_btf/sched_switch")
 int BPF_PROG(sched_switch_btf, bool preempt, struct task_struct *prev, struct task_struct *next)
 {
-	u32 key;
+	flexguard_task_t *t;
+	flexguard_process_t __arena *process;
 	flexguard_qnode_ptr qnode;
-	int *thread_id;
+	int thread_id;
+	u32 flags;
+	s64 state;
 
 	/*
 	 * Clear preempted status of next thread.
-	 * Optimization: skip if next is a kernel thread.
+	 * Optimization: skip if next is a kernel thread or from another process.
+	 * A task is always switched out before being switched in elsewhere,
+	 * so preempted is never updated concurrently.
 	 */
-	if (!(next->flags & 0x00200000)) // PF_KTHREAD
+	if (is_flexguard_task(next))
 	{
-		key = next->pid;
-		if (bpf_map_delete_elem(&is_preempted_map, &key) == 0)
-			__sync_fetch_and_add(&num_preempted_cs, -1);
+		t = bpf_task_storage_get(&task_map, next, NULL, 0);
+		if (t && t->preempted)
+		{
+			flags = t->preempted;
+			t->preempted = 0;
+
+			if (flags & PREEMPTED_SLEEPING)
+				update_sleep_average(t);
+
+			thread_id = t->thread_id;
+			if (thread_id >= 0 && thread_id < MAX_ARENA_THREADS && t->process >= 0 && t->process < FLEXGUARD_MAX_PROCESSES)
+			{
+				process = &processes[t->process];
+				account_preemption(process, &process->qnodes[thread_id], flags, -1);
+			}
+		}
 	}
 
 	/*
-	 * Optimization: No map lookup if prev is a kernel thread.
+	 * Optimization: No lookup if prev is a kernel thread or from another process.
 	 */
-	if (prev->flags & 0x00200000) // PF_KTHREAD
+	if (!is_flexguard_task(prev))
 		return 0;
 
 	/*
 	 * Retrieve prev's qnode.
 	 */
-	key = prev->pid;
-	thread_id = bpf_map_lookup_elem(&nodes_map, &key);
-	if (!thread_id || *thread_id < 0 || *thread_id >= MAX_NUMBER_THREADS || !(qnode = &qnodes[*thread_id]))
+	t = bpf_task_storage_get(&task_map, prev, NULL, 0);
+	if (!t)
 		return 0;
-
-	if (get_task_state(prev) & ((((TASK_INTERRUPTIBLE | TASK_UNINTERRUPTIBLE | TASK_STOPPED | TASK_TRACED | EXIT_DEAD | EXIT_ZOMBIE | TASK_PARKED) + 1) << 1) - 1))
+	thread_id = t->thread_id;
+	if (thread_id < 0 || thread_id >= MAX_ARENA_THREADS || t->process < 0 || t->process >= FLEXGUARD_MAX_PROCESSES)
 		return 0;
+	process = &processes[t->process];
+	qnode = &process->qnodes[thread_id];
 
-	if (qnode->cs_counter && is_critical_thread(prev, qnode))
+	flags = 0;
+
+#ifdef HYBRID_MCS
+	/*
+	 * Waiters going off-cpu in the MCS queue, for any reason,
+	 * are skipped by their predecessor on handoff.
+	 */
+	if (qnode->waiting == 1)
+		flags |= PREEMPTED_WAITER;
+#endif
+
+	/*
+	 * Threads throttled by their cgroup cpu.max quota are dequeued while
+	 * still runnable, and are accounted as preempted here as well.
+	 */
+	state = get_task_state(prev);
+	if (!(state & ((((TASK_INTERRUPTIBLE | TASK_UNINTERRUPTIBLE | TASK_STOPPED | TASK_TRACED | EXIT_DEAD | EXIT_ZOMBIE | TASK_PARKED) + 1) << 1) - 1)))
+		flags |= runnable_flags(qnode);
+	else if (state & (TASK_INTERRUPTIBLE | TASK_UNINTERRUPTIBLE))
+		flags |= sleeping_holder_flags(t, qnode);
+
+#ifdef TIMESLICE_EXTENSION_SCX
+	qnode->extended = 0; // Extensions last until the next switch
+#endif
+
+	if (flags)
 	{
-		DPRINT("Detected preemption: %s (%d) -> %s (%d)", prev->comm, prev->pid, next->comm, next->pid);
-		bpf_map_update_elem(&is_preempted_map, &key, &key, BPF_NOEXIST);
-		__sync_fetch_and_add(&num_preempted_cs, 1);
+		t->preempted = flags;
+		DPRINT("Detected preemption (%u): %s (%d) -> %s (%d)", flags, prev->comm, prev->pid, next->comm, next->pid);
+		account_preemption(process, qnode, flags, 1);
 	}
 
 	return 0;
 }
+
+/*
+ * A thread woken up in a cgroup throttled by CFS bandwidth control cannot run
+ * before the next quota period. It is accounted as preempted until it is
+ * scheduled in. The rq lock of p, held by the waker, serializes with its
+ * switches. Wakeups of threads still on a cpu (ttwu_runnable) are skipped,
+ * no switch in would undo them, as are threads already accounted runnable.
+ */
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(sched_wakeup_btf, struct task_struct *p)
+{
+	flexguard_task_t *t;
+	flexguard_process_t __arena *process;
+	flexguard_qnode_ptr qnode;
+	u32 flags;
+
+	if (!is_flexguard_task(p) || BPF_CORE_READ(p, on_cpu) || !task_throttled(p))
+		return 0;
+
+	t = bpf_task_storage_get(&task_map, p, NULL, 0);
+	if (!t || (t->preempted & PREEMPTED_RUNNABLE) || t->thread_id < 0 || t->thread_id >= MAX_ARENA_THREADS || t->process < 0 || t->process >= FLEXGUARD_MAX_PROCESSES)
+		return 0;
+	process = &processes[t->process];
+	qnode = &process->qnodes[t->thread_id];
+
+	flags = runnable_flags(qnode);
+	if (t->preempted & (PREEMPTED_CS | PREEMPTED_NESTED | PREEMPTED_READER))
+		flags = PREEMPTED_RUNNABLE; // Held locks accounted when it went to sleep
+
+	t->preempted |= flags;
+	DPRINT("Detected throttling (%u): %s (%d)", flags, p->comm, p->pid);
+	account_preemption(process, qnode, flags, 1);
+	return 0;
+}
+
+#ifdef FLEXGUARD_SCX
+/*
+ * sched_ext scheduler of the registered threads of all processes, loaded with the monitor.
+ */
+static __always_inline flexguard_qnode_ptr get_qnode(struct task_struct *p)
+{
+	flexguard_task_t *t;
+
+	if (!is_flexguard_task(p))
+		return NULL;
+
+	t = bpf_task_storage_get(&task_map, p, NULL, 0);
+	if (!t || t->thread_id < 0 || t->thread_id >= MAX_ARENA_THREADS || t->process < 0 || t->process >= FLEXGUARD_MAX_PROCESSES)
+		return NULL;
+	return &processes[t->process].qnodes[t->thread_id];
+}
+#endif
+
+#ifdef TIMESLICE_EXTENSION_SCX
+/*
+ * Extend, once, the time slice of threads whose slice expires in a critical
+ * section. The thread yields at its next unlock.
+ */
+SEC("struct_ops/flexguard_tick")
+void BPF_PROG(flexguard_tick, struct task_struct *p)
+{
+	struct task_struct___scx *task = (void *)p;
+	flexguard_qnode_ptr qnode;
+
+	if (task->scx.slice || !(qnode = get_qnode(p)))
+		return;
+
+	if (qnode->extended || !qnode->cs_counter || !is_critical_thread(qnode))
+		return;
+
+	qnode->extended = 1;
+	task->scx.slice = FLEXGUARD_SLICE_EXTENSION_NS;
+	DPRINT("Extended time slice: %s (%d)", p->comm, p->pid);
+}
+#endif
+
+#ifdef FLEXGUARD_SCX_YIELD
+/*
+ * Directed yield: threads queued while holding a lock, the ones the monitor
+ * reports as preempted, run before the others (bounded by FLEXGUARD_HOLDERS_BATCH).
+ * The cpu a waiter gives up when it blocks on BLOCKING_CONDITION goes to the
+ * preempted holder instead of unrelated threads. Other threads are scheduled
+ * in a global FIFO.
+ */
+SEC("struct_ops.s/flexguard_init")
+s32 BPF_PROG(flexguard_init)
+{
+	s32 err = scx_bpf_create_dsq(FLEXGUARD_DSQ_HOLDERS, -1);
+	return err ? err : scx_bpf_create_dsq(FLEXGUARD_DSQ_SHARED, -1);
+}
+
+SEC("struct_ops/flexguard_enqueue")
+void BPF_PROG(flexguard_enqueue, struct task_struct *p, u64 enq_flags)
+{
+	flexguard_qnode_ptr qnode = get_qnode(p);
+	u64 dsq = FLEXGUARD_DSQ_SHARED;
+
+	if (qnode && (qnode->cs_counter > 1 || qnode->rcs_counter || (qnode->cs_counter && is_critical_thread(qnode))))
+		dsq = FLEXGUARD_DSQ_HOLDERS;
+
+	scx_bpf_dsq_insert(p, dsq, SCX_SLICE_DFL, enq_flags);
+}
+
+int holders_streak = 0; // Holders dispatched in a row, shared by all cpus (racy, only a bound)
+
+SEC("struct_ops/flexguard_dispatch")
+void BPF_PROG(flexguard_dispatch, s32 cpu, struct task_struct *prev)
+{
+	if (holders_streak < FLEXGUARD_HOLDERS_BATCH && scx_bpf_dsq_move_to_local(FLEXGUARD_DSQ_HOLDERS))
+	{
+		holders_streak++;
+		return;
+	}
+
+	holders_streak = 0;
+	if (!scx_bpf_dsq_move_to_local(FLEXGUARD_DSQ_SHARED))
+		scx_bpf_dsq_move_to_local(FLEXGUARD_DSQ_HOLDERS);
+}
+#endif
+
+#ifdef FLEXGUARD_SCX
+/*
+ * Only the registered threads, moved to SCHED_EXT, run under this scheduler.
+ * Without FLEXGUARD_SCX_YIELD, scheduling decisions other than the time slice
+ * extension are left to the default global FIFO of sched_ext.
+ */
+SEC(".struct_ops.link")
+struct sched_ext_ops flexguard_ops = {
+#ifdef TIMESLICE_EXTENSION_SCX
+	.tick = (void *)flexguard_tick,
+#endif
+#ifdef FLEXGUARD_SCX_YIELD
+	.init = (void *)flexguard_init,
+	.enqueue = (void *)flexguard_enqueue,
+	.dispatch = (void *)flexguard_dispatch,
+#endif
+	.flags = SCX_OPS_SWITCH_PARTIAL,
+	.name = "flexguard",
+};
+#endif
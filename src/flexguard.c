@@ -30,49 +30,255 @@
 #include "flexguard.h"
 
 #ifdef BPF
+#include <signal.h>
+#include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include "flexguard.skel.h"
 #endif
 
 _Atomic(int) thread_count = 1;
-_Atomic(int) lock_count = 0;
+_Atomic(uint32_t) lock_count = 0; // Highest lock id given out
 flexguard_qnode_ptr qnode_allocation_array;
 
 num_preempted_cs_t *num_preempted_cs;
+num_preempted_cs_t *num_preempted_readers;
+num_preempted_cs_t *num_preempted_threads;
+flexguard_lock_preempted_t *lock_preempted_cs;
 
+/*
+ * Block if a holder of this lock is preempted.
+ * Unregistered locks fall back to the process-wide count.
+ */
 #ifndef BLOCKING_CONDITION
-#define BLOCKING_CONDITION(the_lock) *num_preempted_cs
+#define BLOCKING_CONDITION(the_lock)                      \
+    ((the_lock)->id != FLEXGUARD_UNREGISTERED_LOCK        \
+         ? lock_preempted_cs[(the_lock)->id].count        \
+         : *num_preempted_cs)
+#endif
+
+/*
+ * Waiters of a reader-writer lock should also block if a reader is preempted
+ * as writers wait for all readers to leave.
+ */
+#ifndef RWLOCK_BLOCKING_CONDITION
+#define RWLOCK_BLOCKING_CONDITION(the_lock) (BLOCKING_CONDITION(&(the_lock)->writer_lock) || *num_preempted_readers)
+#endif
+
+/*
+ * Barrier waiters block while threads are preempted, as the cpus are
+ * oversubscribed and threads still to arrive may be waiting for one.
+ */
+#ifndef BARRIER_BLOCKING_CONDITION
+#define BARRIER_BLOCKING_CONDITION (*num_preempted_threads)
+#endif
+
+/*
+ * Semaphore waiters block behind sleeping waiters, or if threads are preempted.
+ */
+#ifndef SEM_BLOCKING_CONDITION
+#define SEM_BLOCKING_CONDITION(sem) ((sem)->sleepers || *num_preempted_cs || *num_preempted_threads)
+#endif
+
+#define TIMED_OUT(abstime) ((abstime) && deadline_passed(abstime))
+
+/*
+ * Condition variable waiters are requeued to the lock on broadcast
+ * when they would block on it.
+ */
+#ifdef CONDVARS_BLOCK
+#define COND_REQUEUE(the_lock) 1
+#else
+#define COND_REQUEUE(the_lock) BLOCKING_CONDITION(the_lock)
 #endif
 
+#define RWLOCK_WRITER 1
+#define RWLOCK_WRITER_SLEEPING 2
+#define RWLOCK_READER 4
+
 __thread int thread_id = -1;
+static pthread_key_t qnode_key;
+
+/*
+ * Lock-free stack of the qnodes released by exited threads.
+ * Low half: id + 1 of the top qnode (0 if empty), high half: ABA tag bumped on pop.
+ */
+static volatile uint64_t free_qnodes = 0;
+
+/*
+ * Same stack for the ids of destroyed locks, lock_next_free[id] holding the
+ * id of the next one.
+ */
+static volatile uint64_t free_lock_ids = 0;
+static volatile uint32_t *lock_next_free;
+
+#ifdef HYBRID_MCS
+/*
+ * Thread ids below it were given out by the parent of fork(2), whose qnodes
+ * queue tails copied by fork may still name.
+ */
+static int parent_threads = 0;
+#endif
+
+#ifdef HYBRID_CLH
+/*
+ * CLH nodes left as the queue tail of destroyed locks, owned by no thread,
+ * reused by the next locks initialized and threads.
+ */
+static flexguard_qnode_ptr *spare_clh_nodes = NULL;
+static size_t spare_clh_count = 0, spare_clh_capacity = 0;
+static volatile uint8_t spare_clh_lock = 0;
+
+// All CLH nodes allocated, released in forked children (under spare_clh_lock)
+static flexguard_qnode_ptr *all_clh_nodes = NULL;
+static size_t all_clh_count = 0, all_clh_capacity = 0;
+#endif
+
+#ifdef BPF
+int register_thread_fd;
+int unregister_thread_fd;
+
+flexguard_process_t *processes;
+int process_id = -1; // Index of the arena tables of this process, -1 if none
+#endif
+
+#ifdef FLEXGUARD_SCX
+#ifndef SCHED_EXT
+#define SCHED_EXT 7
+#endif
+static bool scx_attached = false; // Registered threads are moved to the sched_ext scheduler
+#endif
+
+static void push_free_qnode(int id)
+{
+    uint64_t head, new;
+    do
+    {
+        head = free_qnodes;
+        qnode_allocation_array[id].next_free = (uint32_t)head;
+        new = (head & ~0xFFFFFFFFULL) | (uint32_t)(id + 1);
+    } while (!__sync_bool_compare_and_swap(&free_qnodes, head, new));
+}
+
+static int pop_free_qnode()
+{
+    uint64_t head, new;
+    uint32_t top;
+    do
+    {
+        head = free_qnodes;
+        top = (uint32_t)head;
+        if (top == 0)
+            return -1;
+        new = (((head >> 32) + 1) << 32) | qnode_allocation_array[top - 1].next_free;
+    } while (!__sync_bool_compare_and_swap(&free_qnodes, head, new));
+
+    return top - 1;
+}
+
+static void push_free_lock_id(uint32_t id)
+{
+    uint64_t head, new;
+    do
+    {
+        head = free_lock_ids;
+        lock_next_free[id] = (uint32_t)head;
+        new = (head & ~0xFFFFFFFFULL) | id;
+    } while (!__sync_bool_compare_and_swap(&free_lock_ids, head, new));
+}
+
+/*
+ * Returns FLEXGUARD_UNREGISTERED_LOCK if no id is free.
+ */
+static uint32_t pop_free_lock_id()
+{
+    uint64_t head, new;
+    uint32_t top;
+    do
+    {
+        head = free_lock_ids;
+        top = (uint32_t)head;
+        if (top == FLEXGUARD_UNREGISTERED_LOCK)
+            return FLEXGUARD_UNREGISTERED_LOCK;
+        new = (((head >> 32) + 1) << 32) | lock_next_free[top];
+    } while (!__sync_bool_compare_and_swap(&free_lock_ids, head, new));
+
+    return top;
+}
+
+/*
+ * TLS destructor giving the qnode of an exiting thread back for reuse.
+ * The qnode is out of every queue as the thread is not acquiring a lock.
+ */
+static void release_qnode(void *UNUSED(value))
+{
+    if (thread_id < 0)
+        return;
 
 #ifdef BPF
-struct bpf_map *nodes_map;
+    LIBBPF_OPTS(bpf_test_run_opts, opts);
+    int err = bpf_prog_test_run_opts(unregister_thread_fd, &opts);
+    if (err)
+        fprintf(stderr, "Failed to unregister thread from BPF: %d\n", err);
+#endif
+
+    push_free_qnode(thread_id);
+    thread_id = -1;
+}
+
+static void flexguard_global_init();
+#ifdef HYBRID_CLH
+static flexguard_qnode_ptr clh_node_alloc();
 #endif
 
 static inline flexguard_qnode_ptr get_me()
 {
     if (UNLIKELY(thread_id < 0))
     {
-        thread_id = atomic_fetch_add(&thread_count, 1);
-        CHECK_NUMBER_THREADS_FATAL(thread_id);
+        flexguard_global_init();
+
+        thread_id = pop_free_qnode();
+        bool recycled = thread_id >= 0;
+        if (!recycled)
+            thread_id = atomic_fetch_add(&thread_count, 1);
+        CHECK_NUMBER_ARENA_THREADS_FATAL(thread_id);
+        pthread_setspecific(qnode_key, (void *)1); // Non-NULL for the destructor to run
 
         flexguard_qnode_ptr qnode = &qnode_allocation_array[thread_id];
 
 #ifdef BPF
-        // Register thread in BPF map
-        __u32 tid = gettid();
-        int err = bpf_map__update_elem(nodes_map, &tid, sizeof(tid), &thread_id, sizeof(thread_id), BPF_ANY);
-        if (err)
-            fprintf(stderr, "Failed to register thread with BPF: %d\n", err);
+        // Register thread in its BPF task storage
+        flexguard_register_args_t args = {.process = process_id, .thread_id = thread_id};
+        LIBBPF_OPTS(bpf_test_run_opts, opts, .ctx_in = &args, .ctx_size_in = sizeof(args));
+        int err = process_id < 0 ? 0 : bpf_prog_test_run_opts(register_thread_fd, &opts);
+        if (err || opts.retval)
+            fprintf(stderr, "Failed to register thread with BPF: %d\n", err ? err : (int)opts.retval);
+
+#ifdef FLEXGUARD_SCX
+        // The scheduler only runs SCHED_EXT tasks (SCX_OPS_SWITCH_PARTIAL)
+        struct sched_param param = {.sched_priority = 0};
+        if (scx_attached && sched_setscheduler(0, SCHED_EXT, &param) != 0)
+            perror("Failed to move thread to the sched_ext scheduler");
+#endif
 
         qnode->cs_counter = 0;
+        qnode->descheduled = 0;
+        qnode->phase = FLEXGUARD_PHASE_HOLDING;
 #endif
 
 #ifdef HYBRID_TICKET
         qnode->ticket = 0;
+        qnode->calling = NULL;
 #elif defined(HYBRID_CLH)
-        qnode->done = 1;
+        /*
+         * Recycled qnodes keep the CLH node of their previous thread. Nodes are
+         * private memory, not the qnode in the arena shared with forked children,
+         * so that queue tails copied by fork(2) are the child's own nodes.
+         */
+        if (!recycled)
+        {
+            qnode->clh_node = clh_node_alloc();
+            qnode->clh_node->done = 1;
+        }
         qnode->pred = NULL;
 #elif defined(HYBRID_MCS)
         qnode->waiting = 0;
@@ -84,32 +290,264 @@ static inline flexguard_qnode_ptr get_me()
     return &qnode_allocation_array[thread_id];
 }
 
-static inline void mcs_exit(flexguard_lock_t *the_lock, flexguard_qnode_ptr qnode)
+/*
+ * Publish the lock id so that a preemption is only accounted to the locks held.
+ */
+static inline void push_held_lock(flexguard_qnode_ptr qnode, flexguard_lock_t *the_lock)
 {
-    if (!qnode->next) // I seem to have no successor
-    {
-        // Trying to fix global pointer
-        if (__sync_val_compare_and_swap(&the_lock->queue, qnode, NULL) == qnode)
-            return;
+#ifdef BPF
+    if (qnode->cs_counter < FLEXGUARD_MAX_NESTED_LOCKS)
+        qnode->held_locks[qnode->cs_counter] = the_lock->id;
+    qnode->cs_counter++; // Intel/AMD
+    // atomic_fetch_add_explicit(&qnode->cs_counter, 1, memory_order_acquire); // ARM
+#endif
+}
+
+static inline void pop_held_lock(flexguard_qnode_ptr qnode, flexguard_lock_t *the_lock)
+{
+#ifdef BPF
+    uint8_t i, top = qnode->cs_counter - 1;
 
-        while (!qnode->next)
+    // Locks are usually released in reverse order
+    if (top >= FLEXGUARD_MAX_NESTED_LOCKS || qnode->held_locks[top] != the_lock->id)
+    {
+        for (i = 0; i < top && i < FLEXGUARD_MAX_NESTED_LOCKS; i++)
         {
-#ifdef FLEXGUARD_ALL
-            if (BLOCKING_CONDITION(the_lock))
+            if (qnode->held_locks[i] == the_lock->id)
             {
-                if (__sync_val_compare_and_swap(&qnode->next, NULL, 1) == NULL)
-                    while (qnode->next == (void *)1)
-                        futex_wait((void *)&qnode->next, 1);
+                qnode->held_locks[i] = top < FLEXGUARD_MAX_NESTED_LOCKS ? qnode->held_locks[top] : FLEXGUARD_UNREGISTERED_LOCK;
                 break;
             }
-            else
+        }
+    }
+
+    qnode->cs_counter--; // Intel/AMD
+    // atomic_fetch_sub_explicit(&qnode->cs_counter, 1, memory_order_release); // ARM
+
+#ifdef TIMESLICE_EXTENSION_SCX
+    // Give back the cpu of an extended time slice, locks are released
+    if (UNLIKELY(qnode->extended) && qnode->cs_counter == 0)
+    {
+        qnode->extended = 0;
+        sched_yield();
+    }
+#endif
+#endif
+}
+
+#ifdef FLEXGUARD_NUMA
+/*
+ * Node of the current cpu as reported by the kernel (vDSO), cpus of a node
+ * are not necessarily numbered contiguously.
+ */
+static inline int current_numa_node()
+{
+    unsigned int cpu, node;
+    if (getcpu(&cpu, &node) != 0)
+        return 0;
+    return node % NUMA_NODES;
+}
+
+/*
+ * Hand the lock to a waiter of the holder's node without releasing lock_value,
+ * at most FLEXGUARD_NUMA_BATCH times in a row.
+ * Returns 1 if the lock was handed over.
+ */
+static inline int numa_handoff(flexguard_lock_t *the_lock)
+{
+    flexguard_numa_queue_t *local = &the_lock->nodes[the_lock->home];
+
+    if (local->queue == NULL || BLOCKING_CONDITION(the_lock))
+        return 0;
+
+    if (--local->batch_count < 0)
+    {
+        local->batch_count = FLEXGUARD_NUMA_BATCH;
+        return 0;
+    }
+
+    /*
+     * Waiters check the grant after leaving the queue, so the grant
+     * is only taken back if the queue emptied in the meantime.
+     */
+    __sync_val_compare_and_swap(&local->grant, 0, 1);
+    return local->queue != NULL || !__sync_bool_compare_and_swap(&local->grant, 1, 0);
+}
+#endif
+
+#ifdef HYBRID_MCS
+/*
+ * Whether pred was enqueued by this process, and not by the parent of fork(2)
+ * in its own tables or in ours. Otherwise, linking behind it would write to
+ * qnodes of threads that do not exist here and never pass us the queue.
+ */
+static inline int own_qnode(flexguard_qnode_ptr pred)
+{
+    return pred >= &qnode_allocation_array[parent_threads] && pred < &qnode_allocation_array[MAX_ARENA_THREADS];
+}
+
+/*
+ * Wait for the successor to link itself and hand it the head of the queue.
+ */
+static inline void mcs_pass(flexguard_lock_t *the_lock, flexguard_qnode_ptr qnode)
+{
+    while (!qnode->next)
+    {
+#ifdef FLEXGUARD_ALL
+        if (BLOCKING_CONDITION(the_lock))
+        {
+            if (__sync_val_compare_and_swap(&qnode->next, NULL, 1) == NULL)
+                while (qnode->next == (void *)1)
+                    futex_wait((void *)&qnode->next, 1);
+            break;
+        }
+        else
+#endif
+            PAUSE;
+    }
+
+    flexguard_qnode_ptr succ = qnode->next;
+
+#ifdef BPF
+    /*
+     * Skip successors descheduled while waiting, as long as they are followed by another waiter.
+     * Skipped waiters (waiting = 2) enqueue again once running. Waiters that left
+     * their spin (waiting = 3) are past the check and are never skipped.
+     */
+    flexguard_qnode_ptr next;
+    while (succ->descheduled && (next = succ->next) != NULL && next != (void *)1 &&
+           __sync_bool_compare_and_swap(&succ->waiting, 1, 2))
+        succ = next;
+#endif
+
+    succ->waiting = 0;
+}
+
+static inline void mcs_exit(flexguard_lock_t *the_lock, flexguard_qnode_ptr *queue, flexguard_qnode_ptr qnode)
+{
+    // I seem to have no successor, trying to fix global pointer
+    if (!qnode->next && __sync_val_compare_and_swap(queue, qnode, NULL) == qnode)
+        return;
+
+    mcs_pass(the_lock, qnode);
+}
+
+/*
+ * Link qnode behind its predecessor and spin until it is at the head of the queue.
+ * Returns 1 if it was skipped while descheduled and must enqueue again.
+ */
+static inline int mcs_wait(flexguard_lock_t *the_lock, flexguard_qnode_ptr pred, flexguard_qnode_ptr qnode, const struct timespec *abstime)
+{
+#ifdef BPF
+    qnode->phase = FLEXGUARD_PHASE_ENQUEUED;
+#endif
+#ifdef FLEXGUARD_ALL
+    if (atomic_exchange(&pred->next, qnode) == (void *)1) // make pred point to me
+        futex_wake((void *)&pred->next, 1);
+#else
+    pred->next = qnode; // make pred point to me
+#endif
+
+    while (qnode->waiting == 1 && !BLOCKING_CONDITION(the_lock) && !TIMED_OUT(abstime))
+        PAUSE;
+
+#ifdef BPF
+    // Leaving the spin early, still linked in the queue: no longer skippable (waiting = 3)
+    if (qnode->waiting == 1)
+        __sync_val_compare_and_swap(&qnode->waiting, 1, 3);
 #endif
-                PAUSE;
+    return qnode->waiting == 2; // Skipped by the predecessor while descheduled
+}
+#elif defined(HYBRID_CLH)
+static flexguard_qnode_ptr clh_node_alloc()
+{
+    flexguard_qnode_ptr node = NULL;
+
+    while (tas_uint8(&spare_clh_lock))
+        RAW_PAUSE;
+    if (spare_clh_count > 0)
+        node = spare_clh_nodes[--spare_clh_count];
+    spare_clh_lock = 0;
+
+    if (node)
+        return node;
+
+    node = (flexguard_qnode_ptr)calloc(1, sizeof(flexguard_qnode_t));
+    if (!node)
+        return NULL;
+
+    while (tas_uint8(&spare_clh_lock))
+        RAW_PAUSE;
+    if (all_clh_count == all_clh_capacity)
+    {
+        size_t capacity = all_clh_capacity ? 2 * all_clh_capacity : 64;
+        flexguard_qnode_ptr *nodes = realloc(all_clh_nodes, capacity * sizeof(*nodes));
+        if (nodes)
+        {
+            all_clh_nodes = nodes;
+            all_clh_capacity = capacity;
+        }
+    }
+    if (all_clh_count < all_clh_capacity) // Otherwise never released after fork
+        all_clh_nodes[all_clh_count++] = node;
+    spare_clh_lock = 0;
+    return node;
+}
+
+static void clh_node_free(flexguard_qnode_ptr node)
+{
+    while (tas_uint8(&spare_clh_lock))
+        RAW_PAUSE;
+    if (spare_clh_count == spare_clh_capacity)
+    {
+        size_t capacity = spare_clh_capacity ? 2 * spare_clh_capacity : 64;
+        flexguard_qnode_ptr *nodes = realloc(spare_clh_nodes, capacity * sizeof(*nodes));
+        if (!nodes)
+        {
+            spare_clh_lock = 0;
+            return; // Leaked, the node may be in the arena
         }
+        spare_clh_nodes = nodes;
+        spare_clh_capacity = capacity;
     }
+    spare_clh_nodes[spare_clh_count++] = node;
+    spare_clh_lock = 0;
+}
+
+/*
+ * Queue tails copied by fork(2) may be nodes of threads that do not exist in
+ * the child, which would never release them. The child releases all of them:
+ * the queue only orders spinners, lock_value still protects the lock.
+ */
+static void clh_fork_prepare()
+{
+    while (tas_uint8(&spare_clh_lock))
+        RAW_PAUSE;
+}
 
-    qnode->next->waiting = 0;
+static void clh_fork_parent()
+{
+    spare_clh_lock = 0;
+}
+
+static void clh_fork_child()
+{
+    for (size_t i = 0; i < all_clh_count; i++)
+        all_clh_nodes[i]->done = 1;
+    spare_clh_lock = 0;
+}
+
+/*
+ * Release the CLH node to the successor and take the predecessor's node,
+ * which is only usable once its owner has left the queue (done == 1).
+ */
+static inline void clh_exit(flexguard_qnode_ptr qnode)
+{
+    flexguard_qnode_ptr pred = qnode->pred;
+    qnode->clh_node->done = 1;
+    qnode->clh_node = pred;
 }
+#endif
 
 /*
  * Try to acquire the lock without blocking.
@@ -127,17 +565,20 @@ int flexguard_trylock(flexguard_lock_t *the_lock)
         extend();
 #endif
 
-        // Expected value; will be the previous value of the lock after cmpxchg
-        register int expect __asm__("rax") = 0;
-        __asm__ volatile("lock cmpxchgl %2, %0" : "+m"(the_lock->lock_value), "+a"(expect) : "r"(1) : "memory");
-        if (expect == 0)
-        {
 #ifdef BPF
-            qnode->cs_counter++; // Intel/AMD
-// atomic_fetch_add_explicit(&qnode->cs_counter, 1, memory_order_acquire); // ARM
+        qnode->phase = FLEXGUARD_PHASE_HOLDING;
+        push_held_lock(qnode, the_lock);
+#endif
+        if (__sync_val_compare_and_swap(&the_lock->lock_value, 0, 1) == 0)
+        {
+#ifdef FLEXGUARD_NUMA
+            the_lock->home = current_numa_node();
 #endif
             return 0; // Success
         }
+#ifdef BPF
+        pop_held_lock(qnode, the_lock);
+#endif
 #ifdef TIMESLICE_EXTENSION
         unextend();
 #endif
@@ -147,89 +588,141 @@ int flexguard_trylock(flexguard_lock_t *the_lock)
 }
 
 /*
- * Disable optimizations for this function to ensure that branches stay in the right place.
- * or verify that branches are in the right place using `make ASSEMBLY_DUMP=1`.
- *
- * Optimizations are re-enabled on line 230.
+ * Acquire the lock, giving up once abstime (CLOCK_REALTIME) has passed if not NULL.
+ * woken is set by condition variable waiters that may have been requeued to lock_value.
+ * Returns 0 on success, ETIMEDOUT or EINVAL otherwise.
  */
-// #pragma GCC push_options
-// #pragma GCC optimize("O0")
-// __attribute__((noinline)) __attribute__((noipa))
-void flexguard_lock(flexguard_lock_t *the_lock)
+static inline int flexguard_lock_until(flexguard_lock_t *the_lock, const struct timespec *abstime, uint8_t woken)
 {
     flexguard_qnode_ptr qnode = get_me();
+#ifdef FLEXGUARD_NUMA
+    int node = current_numa_node();
+    flexguard_numa_queue_t *local = &the_lock->nodes[node];
+    flexguard_qnode_ptr *queue = &local->queue;
+#elif defined(HYBRID_MCS)
+    flexguard_qnode_ptr *queue = &the_lock->queue;
+#endif
+    uint8_t enqueued = 0;
 
 #ifdef BPF
-    qnode->cs_counter++; // Intel/AMD
-    // atomic_fetch_add_explicit(&qnode->cs_counter, 1, memory_order_acquire); // ARM
+    qnode->phase = FLEXGUARD_PHASE_FASTPATH;
+    push_held_lock(qnode, the_lock);
 #endif
 
-    if (!the_lock->lock_value)
+    if (woken || !the_lock->lock_value)
     {
 #ifdef TIMESLICE_EXTENSION
         extend();
 #endif
 
-        // Expected value; will be the previous value of the lock after cmpxchg
-        register int expect __asm__("rax") = 0;
-        __asm__ volatile("lock cmpxchgl %2, %0" : "+m"(the_lock->lock_value), "+a"(expect) : "r"(1) : "memory");
 #ifdef BPF
-        __asm__ volatile("fg_fastpath:" ::: "memory");
+        qnode->phase = FLEXGUARD_PHASE_HOLDING; // Until the CAS is known to have failed
 #endif
-        if (expect == 0)
-            return;
+        /*
+         * Requeued waiters are woken one at a time by unlocks of lock_value 2,
+         * set it so that the next one is woken in turn.
+         */
+        if ((woken ? __sync_lock_test_and_set(&the_lock->lock_value, 2)
+                   : __sync_val_compare_and_swap(&the_lock->lock_value, 0, 1)) == 0)
+        {
+#ifdef FLEXGUARD_NUMA
+            the_lock->home = node;
+#endif
+            return 0;
+        }
 #ifdef BPF
-        __asm__ volatile("fg_fastpath_out:" ::: "memory");
+        qnode->phase = FLEXGUARD_PHASE_FASTPATH;
 #endif
 #ifdef TIMESLICE_EXTENSION
         unextend();
 #endif
     }
 
+    if (abstime && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+    {
+#ifdef BPF
+        pop_held_lock(qnode, the_lock);
+#endif
+        return EINVAL;
+    }
+
 flexguard_slow_path:
+    LOCK_EVENT(slow_paths);
+
+#ifdef HYBRID_TICKET
+    // LOCK TICKET
+    if (!enqueued && !BLOCKING_CONDITION(the_lock))
+    {
+        enqueued = 1;
+        qnode->calling = &the_lock->ticket_lock.calling;
+
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_SPINNING; // Until the ticket is known not to be called
+#endif
+        qnode->ticket = __sync_fetch_and_add(&the_lock->ticket_lock.next, 1);
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_ENQUEUED;
+#endif
+    }
+
+    /*
+     * Kept after blocking, tickets are only given back once the lock is acquired.
+     * Waiters behind the ticket of a thread sleeping on lock_value thus spin
+     * until it is woken up and acquires the lock, or block themselves once a
+     * holder is preempted: a convoy the MCS and CLH queues avoid by leaving
+     * the queue before sleeping.
+     */
+    if (enqueued)
+        while ((int32_t)(qnode->ticket - the_lock->ticket_lock.calling) > 0 && !BLOCKING_CONDITION(the_lock) && !TIMED_OUT(abstime))
+            PAUSE;
+
+#elif defined(HYBRID_CLH)
+    // LOCK CLH
+    flexguard_qnode_ptr node = qnode->clh_node;
+    if (!BLOCKING_CONDITION(the_lock) && node->done == 1) // Skip the queue until the node left by a previous wait is released
+    {
+        enqueued = 1;
+        node->done = 0;
+
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_SPINNING; // Until pred is published
+#endif
+        qnode->pred = __sync_lock_test_and_set(&the_lock->queue, node);
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_ENQUEUED;
+#endif
 
+        while (qnode->pred->done == 0 && !BLOCKING_CONDITION(the_lock) && !TIMED_OUT(abstime))
+            PAUSE;
+    }
+
+#elif defined(HYBRID_MCS)
     // LOCK MCS
-    uint8_t enqueued = 0;
     if (!BLOCKING_CONDITION(the_lock))
     {
         enqueued = 1;
-        DASSERT(the_lock->queue != qnode);
+        DASSERT(*queue != qnode);
 
         qnode->next = NULL;
         qnode->waiting = 1; // word on which to spin
 
-        // Register rax stores the current qnode and will contain the previous value of
-        // the queue after the xchgq operation.
-        register flexguard_qnode_ptr pred __asm__("rcx") = qnode;
-
-        /*
-         *  Exchange pred (rcx) and queue head.
-         *  Store the pointer to the queue head in a register.
-         *  Uses the value in rcx (pred) as an exchange parameter.
-         */
-        __asm__ volatile("xchgq %0, (%1)" : "+r"(pred) : "r"(&the_lock->queue) : "memory");
-
 #ifdef BPF
-        __asm__ volatile("fg_lock_check_rcx_null:" ::: "memory");
+        qnode->phase = FLEXGUARD_PHASE_SPINNING; // Until the queue is known not to be empty
 #endif
-        if (pred != NULL) /* lock was not free */
+        flexguard_qnode_ptr pred = __sync_lock_test_and_set(queue, qnode);
+        if (pred != NULL && own_qnode(pred) && mcs_wait(the_lock, pred, qnode, abstime)) /* lock was not free */
         {
-#ifdef FLEXGUARD_ALL
-            if (atomic_exchange(&pred->next, qnode) == (void *)1) // make pred point to me
-                futex_wake((void *)&pred->next, 1);
-#else
-            pred->next = qnode; // make pred point to me
-#endif
-
-            while (qnode->waiting != 0 && !BLOCKING_CONDITION(the_lock))
-                PAUSE;
+            enqueued = 0;
+            goto flexguard_slow_path;
         }
     }
+#else
+#error "Unknown Hybrid Lock Version"
+#endif
 
 #ifdef BPF
-    __asm__ volatile("fg_phase2:" ::: "memory");
+    qnode->phase = FLEXGUARD_PHASE_SPINNING;
 #endif
-    // #pragma GCC pop_options // Re-enable optimizations
 
 #ifdef TIMESLICE_EXTENSION
     extend();
@@ -240,13 +733,28 @@ flexguard_slow_path:
         state = __sync_val_compare_and_swap(&the_lock->lock_value, 0, 1);
     while (state != 0)
     {
-        if (BLOCKING_CONDITION(the_lock))
+#ifdef FLEXGUARD_NUMA
+        if (enqueued && local->grant && __sync_bool_compare_and_swap(&local->grant, 1, 0))
+            break; // Handed over by a holder from the same node
+#endif
+
+        if (BLOCKING_CONDITION(the_lock))
         {
+#ifndef HYBRID_TICKET
             if (enqueued)
             {
-                mcs_exit(the_lock, qnode);
+#ifdef HYBRID_CLH
+                clh_exit(qnode);
+#else
+                mcs_exit(the_lock, queue, qnode);
+#endif
                 enqueued = 0;
+#ifdef FLEXGUARD_NUMA
+                if (local->grant && __sync_bool_compare_and_swap(&local->grant, 1, 0))
+                    break; // The queue may have emptied before the grant was seen
+#endif
             }
+#endif
             if (the_lock->lock_value != 2)
                 state = __sync_lock_test_and_set(&the_lock->lock_value, 2);
             if (state != 0)
@@ -254,10 +762,15 @@ flexguard_slow_path:
 #ifdef TIMESLICE_EXTENSION
                 unextend_light();
 #endif
-                futex_wait((void *)&the_lock->lock_value, 2);
+                LOCK_EVENT(sleeps);
+                int timed_out = abstime
+                                    ? futex_wait_until((void *)&the_lock->lock_value, 2, abstime) != 0 && errno == ETIMEDOUT
+                                    : (futex_wait((void *)&the_lock->lock_value, 2), 0);
 #ifdef TIMESLICE_EXTENSION
                 extend_light();
 #endif
+                if (timed_out)
+                    goto flexguard_timed_out;
 
                 state = __sync_lock_test_and_set(&the_lock->lock_value, 2);
                 if (state != 0 && !BLOCKING_CONDITION(the_lock))
@@ -269,18 +782,277 @@ flexguard_slow_path:
             PAUSE;
             if (the_lock->lock_value == 0)
                 state = __sync_val_compare_and_swap(&the_lock->lock_value, 0, 1);
+            else if (TIMED_OUT(abstime))
+                goto flexguard_timed_out;
         }
     }
 
-    // UNLOCK MCS
+#ifdef FLEXGUARD_NUMA
+flexguard_acquired:
+#endif
+#ifdef BPF
+    qnode->phase = FLEXGUARD_PHASE_HOLDING;
+#endif
+#ifdef FLEXGUARD_NUMA
+    the_lock->home = node;
+#endif
+
+    // UNLOCK QUEUE
     if (enqueued)
-        mcs_exit(the_lock, qnode);
+    {
+#ifdef HYBRID_TICKET
+        __sync_fetch_and_add(&the_lock->ticket_lock.calling, 1);
+#elif defined(HYBRID_CLH)
+        clh_exit(qnode);
+#else
+        mcs_exit(the_lock, queue, qnode);
+#endif
+    }
+    return 0;
+
+flexguard_timed_out:
+    // Leave the queue as if the lock had been acquired, the next waiter gets to spin
+    if (enqueued)
+    {
+#ifdef HYBRID_TICKET
+        /*
+         * The ticket may not be called yet, but its turn must still be given
+         * back once. Each timed-out waiter lets one more waiter through to
+         * lock_value early: k timeouts let up to k extra waiters spin there.
+         */
+        __sync_fetch_and_add(&the_lock->ticket_lock.calling, 1);
+#elif defined(HYBRID_CLH)
+        clh_exit(qnode);
+#else
+        mcs_exit(the_lock, queue, qnode);
+#endif
+        enqueued = 0;
+#ifdef FLEXGUARD_NUMA
+        if (local->grant && __sync_bool_compare_and_swap(&local->grant, 1, 0))
+            goto flexguard_acquired; // Handed over before leaving the queue
+#endif
+    }
+
+#ifdef TIMESLICE_EXTENSION
+    unextend();
+#endif
+#ifdef BPF
+    pop_held_lock(qnode, the_lock);
+#endif
+    return ETIMEDOUT;
+}
+
+void flexguard_lock(flexguard_lock_t *the_lock)
+{
+    flexguard_lock_until(the_lock, NULL, 0);
+}
+
+int flexguard_timedlock(flexguard_lock_t *the_lock, const struct timespec *abstime)
+{
+    return flexguard_lock_until(the_lock, abstime, 0);
 }
 
 void flexguard_unlock(flexguard_lock_t *the_lock)
+{
+#ifdef FLEXGUARD_NUMA
+    if (!numa_handoff(the_lock))
+#endif
+        if (__sync_lock_test_and_set(&the_lock->lock_value, 0) != 1)
+            futex_wake((void *)&the_lock->lock_value, 1);
+
+#ifdef TIMESLICE_EXTENSION
+    unextend();
+#endif
+
+#ifdef BPF
+    // Assuming qnode has already been initialized.
+    pop_held_lock(&qnode_allocation_array[thread_id], the_lock);
+#endif
+}
+
+#ifdef HYBRID_MCS
+/*
+ *  Compact Locks
+ */
+
+static flexguard_lock_t unregistered_lock = {.id = FLEXGUARD_UNREGISTERED_LOCK};
+
+static inline void spin_mcs_exit(flexguard_spinlock_t *the_lock, flexguard_qnode_ptr qnode)
+{
+    uint32_t val, tail = (uint32_t)(thread_id + 1) << FLEXGUARD_SPIN_TAIL_SHIFT;
+
+    // I seem to have no successor, trying to clear the tail (lock_value may change meanwhile)
+    while (!qnode->next && ((val = the_lock->val) & ~FLEXGUARD_SPIN_VALUE_MASK) == tail)
+        if (__sync_bool_compare_and_swap(&the_lock->val, val, val & FLEXGUARD_SPIN_VALUE_MASK))
+            return;
+
+    mcs_pass(&unregistered_lock, qnode);
+}
+
+int flexguard_spin_init(flexguard_spinlock_t *the_lock)
+{
+    the_lock->val = 0;
+    flexguard_global_init();
+    MEM_BARRIER;
+    return 0;
+}
+
+void flexguard_spin_destroy(flexguard_spinlock_t *UNUSED(the_lock))
+{
+    // Nothing to do
+}
+
+int flexguard_spin_trylock(flexguard_spinlock_t *the_lock)
+{
+#ifdef BPF
+    flexguard_qnode_ptr qnode = get_me();
+#endif
+
+    if (!the_lock->lock_value)
+    {
+#ifdef TIMESLICE_EXTENSION
+        extend();
+#endif
+
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_HOLDING;
+        push_held_lock(qnode, &unregistered_lock);
+#endif
+        if (__sync_val_compare_and_swap(&the_lock->lock_value, 0, 1) == 0)
+            return 0; // Success
+#ifdef BPF
+        pop_held_lock(qnode, &unregistered_lock);
+#endif
+#ifdef TIMESLICE_EXTENSION
+        unextend();
+#endif
+    }
+
+    return EBUSY; // Locked
+}
+
+/*
+ * Same algorithm as flexguard_lock_until with an MCS queue, except that the
+ * queue tail is swapped into the lock word with a CAS as it shares the word
+ * with lock_value, and that sleepers wait on the whole word.
+ */
+void flexguard_spin_lock(flexguard_spinlock_t *the_lock)
+{
+    flexguard_qnode_ptr qnode = get_me();
+    uint8_t enqueued = 0;
+
+#ifdef BPF
+    qnode->phase = FLEXGUARD_PHASE_FASTPATH;
+    push_held_lock(qnode, &unregistered_lock);
+#endif
+
+    if (!the_lock->lock_value)
+    {
+#ifdef TIMESLICE_EXTENSION
+        extend();
+#endif
+
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_HOLDING; // Until the CAS is known to have failed
+#endif
+        if (__sync_val_compare_and_swap(&the_lock->lock_value, 0, 1) == 0)
+            return;
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_FASTPATH;
+#endif
+#ifdef TIMESLICE_EXTENSION
+        unextend();
+#endif
+    }
+
+flexguard_spin_slow_path:
+    LOCK_EVENT(slow_paths);
+
+    // LOCK MCS
+    if (!BLOCKING_CONDITION(&unregistered_lock))
+    {
+        enqueued = 1;
+        qnode->next = NULL;
+        qnode->waiting = 1; // word on which to spin
+
+#ifdef BPF
+        qnode->phase = FLEXGUARD_PHASE_SPINNING; // Until the queue is known not to be empty
+#endif
+        uint32_t val, tail = (uint32_t)(thread_id + 1) << FLEXGUARD_SPIN_TAIL_SHIFT;
+        do
+            val = the_lock->val;
+        while (!__sync_bool_compare_and_swap(&the_lock->val, val, (val & FLEXGUARD_SPIN_VALUE_MASK) | tail));
+
+        val >>= FLEXGUARD_SPIN_TAIL_SHIFT;
+        if (val != 0 && own_qnode(&qnode_allocation_array[val - 1]) && mcs_wait(&unregistered_lock, &qnode_allocation_array[val - 1], qnode, NULL)) /* lock was not free */
+        {
+            enqueued = 0;
+            goto flexguard_spin_slow_path;
+        }
+    }
+
+#ifdef BPF
+    qnode->phase = FLEXGUARD_PHASE_SPINNING;
+#endif
+
+#ifdef TIMESLICE_EXTENSION
+    extend();
+#endif
+
+    int state = the_lock->lock_value;
+    if (state == 0)
+        state = __sync_val_compare_and_swap(&the_lock->lock_value, 0, 1);
+    while (state != 0)
+    {
+        if (BLOCKING_CONDITION(&unregistered_lock))
+        {
+            if (enqueued)
+            {
+                spin_mcs_exit(the_lock, qnode);
+                enqueued = 0;
+            }
+
+            if (the_lock->lock_value != 2)
+                state = __sync_lock_test_and_set(&the_lock->lock_value, 2);
+            if (state != 0)
+            {
+#ifdef TIMESLICE_EXTENSION
+                unextend_light();
+#endif
+                LOCK_EVENT(sleeps);
+                uint32_t val = the_lock->val;
+                if ((val & FLEXGUARD_SPIN_VALUE_MASK) == 2) // The tail may have changed the word meanwhile
+                    futex_wait((void *)&the_lock->val, val);
+#ifdef TIMESLICE_EXTENSION
+                extend_light();
+#endif
+
+                state = __sync_lock_test_and_set(&the_lock->lock_value, 2);
+                if (state != 0 && !BLOCKING_CONDITION(&unregistered_lock))
+                    goto flexguard_spin_slow_path;
+            }
+        }
+        else
+        {
+            PAUSE;
+            if (the_lock->lock_value == 0)
+                state = __sync_val_compare_and_swap(&the_lock->lock_value, 0, 1);
+        }
+    }
+
+#ifdef BPF
+    qnode->phase = FLEXGUARD_PHASE_HOLDING;
+#endif
+
+    // UNLOCK QUEUE
+    if (enqueued)
+        spin_mcs_exit(the_lock, qnode);
+}
+
+void flexguard_spin_unlock(flexguard_spinlock_t *the_lock)
 {
     if (__sync_lock_test_and_set(&the_lock->lock_value, 0) != 1)
-        futex_wake((void *)&the_lock->lock_value, 1);
+        futex_wake((void *)&the_lock->val, 1);
 
 #ifdef TIMESLICE_EXTENSION
     unextend();
@@ -288,10 +1060,10 @@ void flexguard_unlock(flexguard_lock_t *the_lock)
 
 #ifdef BPF
     // Assuming qnode has already been initialized.
-    qnode_allocation_array[thread_id].cs_counter--; // Intel/AMD
-    // atomic_fetch_sub_explicit(&qnode_allocation_array[thread_id].cs_counter, 1, memory_order_release); // ARM
+    pop_held_lock(&qnode_allocation_array[thread_id], &unregistered_lock);
 #endif
 }
+#endif
 
 #ifdef BPF
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
@@ -305,48 +1077,152 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
 #endif
 
 #ifdef BPF
+_Static_assert(FLEXGUARD_ARENA_SIZE < (1ULL << 32), "BPF arenas are limited to 4GB, decrease FLEXGUARD_MAX_PROCESSES");
+
+/*
+ * Take free arena tables, or those of a process that exited.
+ * Processes beyond FLEXGUARD_MAX_PROCESSES use private tables and are not
+ * registered, their preemptions are not detected.
+ */
+static void use_process_tables()
+{
+    int tgid = getpid();
+
+    process_id = -1;
+    for (int i = 0; i < FLEXGUARD_MAX_PROCESSES && process_id < 0; i++)
+    {
+        int owner = processes[i].tgid;
+        if ((owner == 0 || (kill(owner, 0) != 0 && errno == ESRCH)) &&
+            __sync_bool_compare_and_swap(&processes[i].tgid, owner, tgid))
+            process_id = i;
+    }
+
+    flexguard_process_t *process;
+    if (process_id < 0)
+    {
+        fprintf(stderr, "Too many processes, increase FLEXGUARD_MAX_PROCESSES in platform_defs.h.\n");
+        process = alloc_on_demand(sizeof(flexguard_process_t));
+    }
+    else
+    {
+        // Tables of exited processes are reset, allocating the arena pages of the locks in use
+        process = &processes[process_id];
+        process->num_preempted_cs = 0;
+        process->num_preempted_readers = 0;
+        process->num_preempted_threads = 0;
+
+        uint32_t count = lock_count;
+        for (uint32_t id = 0; id <= count && id < MAX_ARENA_LOCKS; id++)
+            process->lock_preempted_cs[id].count = 0;
+    }
+
+    qnode_allocation_array = process->qnodes;
+    lock_preempted_cs = process->lock_preempted_cs;
+    num_preempted_cs = &process->num_preempted_cs;
+    num_preempted_readers = &process->num_preempted_readers;
+    num_preempted_threads = &process->num_preempted_threads;
+}
+
+/*
+ * The child of fork(2) shares the arena and the BPF program with its parent.
+ * It takes its own tables and moves the forking thread, the only one left,
+ * to a new qnode keeping the locks it holds. Locks copied by fork may have
+ * MCS queue tails naming the parent's qnodes: thread ids are not reused so
+ * that own_qnode tells them apart, and the next waiter ignores them rather
+ * than linking into the parent's queue. CLH nodes are outside the arena: the
+ * child has its own copies of them, released by clh_fork_child. Tickets taken
+ * by other threads at fork time are never given back: these ticket locks
+ * are unusable in the child.
+ */
+static void flexguard_fork_child()
+{
+    flexguard_qnode_t parent_qnode;
+    int registered = thread_id >= 0;
+    if (registered)
+        parent_qnode = *(flexguard_qnode_t *)&qnode_allocation_array[thread_id];
+
+    use_process_tables();
+#ifdef HYBRID_MCS
+    parent_threads = thread_count;
+#else
+    thread_count = 1;
+#endif
+    free_qnodes = 0;
+    thread_id = -1;
+
+    if (registered)
+    {
+        flexguard_qnode_ptr qnode = get_me();
+        qnode->cs_counter = parent_qnode.cs_counter;
+        qnode->rcs_counter = parent_qnode.rcs_counter;
+        for (int i = 0; i < FLEXGUARD_MAX_NESTED_LOCKS; i++)
+            qnode->held_locks[i] = parent_qnode.held_locks[i];
+        MEM_BARRIER;
+    }
+}
+
 static void deploy_bpf_code()
 {
     struct flexguard_bpf *skel;
     int err;
 
-    // Open BPF skeleton
     libbpf_set_print(libbpf_print_fn);
-    skel = flexguard_bpf__open();
-    if (!skel)
+
+#ifdef FLEXGUARD_SCX
+    // The scheduler is skipped on kernels without sched_ext
+    bool scx = access("/sys/kernel/sched_ext", F_OK) == 0;
+#endif
+
+    while (1)
     {
-        fprintf(stderr, "Failed to open BPF skeleton\n");
-        exit(EXIT_FAILURE);
-    }
+        // Open BPF skeleton
+        skel = flexguard_bpf__open();
+        if (!skel)
+        {
+            fprintf(stderr, "Failed to open BPF skeleton\n");
+            exit(EXIT_FAILURE);
+        }
 
-#ifdef HYBRID_MCS
-    skel->bss->addresses.lock = &flexguard_lock;
+#ifdef FLEXGUARD_SCX
+        bpf_map__set_autoload(skel->maps.flexguard_ops, scx);
+        bpf_map__set_autoattach(skel->maps.flexguard_ops, false);
+#endif
 
-    extern char fg_fastpath;
-    skel->bss->addresses.fastpath = &fg_fastpath;
-    extern char fg_fastpath_out;
-    skel->bss->addresses.fastpath_out = &fg_fastpath_out;
+        // Load BPF skeleton
+        err = flexguard_bpf__load(skel);
+        if (!err)
+            break;
 
-    extern char fg_lock_check_rcx_null;
-    skel->bss->addresses.lock_check_rcx_null = &fg_lock_check_rcx_null;
-    extern char fg_phase2;
-    skel->bss->addresses.phase2 = &fg_phase2;
+        flexguard_bpf__destroy(skel);
+#ifdef FLEXGUARD_SCX
+        if (scx)
+        {
+            // Loaded with the monitor, retried without the scheduler
+            fprintf(stderr, "Failed to load the sched_ext scheduler (%d), running without it\n", err);
+            scx = false;
+            continue;
+        }
 #endif
+        fprintf(stderr, "Failed to load and verify BPF skeleton (%d)\n", err);
+        exit(EXIT_FAILURE);
+    }
 
-    num_preempted_cs = &skel->bss->num_preempted_cs;
-    qnode_allocation_array = skel->bss->qnodes;
+    register_thread_fd = bpf_program__fd(skel->progs.register_thread);
+    unregister_thread_fd = bpf_program__fd(skel->progs.unregister_thread);
 
-    // Load BPF skeleton
-    err = flexguard_bpf__load(skel);
-    if (err)
+    // Tables live in the arena, mapped by libbpf on load
+    size_t arena_size;
+    void *arena = bpf_map__initial_value(skel->maps.arena, &arena_size);
+    if (!arena || arena_size < FLEXGUARD_ARENA_SIZE)
     {
-        fprintf(stderr, "Failed to load and verify BPF skeleton (%d)\n", err);
+        fprintf(stderr, "Failed to map BPF arena\n");
         flexguard_bpf__destroy(skel);
         exit(EXIT_FAILURE);
     }
 
-    // Store map
-    nodes_map = skel->maps.nodes_map;
+    processes = arena + FLEXGUARD_ARENA_PROCESSES_OFFSET;
+    skel->arena->processes = processes;
+    use_process_tables();
 
     // Attach BPF skeleton
     err = flexguard_bpf__attach(skel);
@@ -356,46 +1232,500 @@ static void deploy_bpf_code()
         flexguard_bpf__destroy(skel);
         exit(EXIT_FAILURE);
     }
+
+#ifdef FLEXGUARD_SCX
+    // The scheduler stays attached while this process or its children live
+    scx_attached = scx && bpf_map__attach_struct_ops(skel->maps.flexguard_ops);
+    if (scx && !scx_attached)
+        fprintf(stderr, "Failed to attach the sched_ext scheduler, running without it\n");
+#endif
 }
 #endif
 
-int flexguard_init(flexguard_lock_t *the_lock)
+/*
+ * Process-wide initialization, done by the first lock initialized
+ * or, for zero-initialized locks, the first thread to take a qnode.
+ */
+static void flexguard_global_init()
 {
-    the_lock->lock_value = 0;
-
     static volatile uint8_t init_lock = 0;
     if (exactly_once(&init_lock) == 0)
     {
+#ifdef HYBRID_CLH
+        pthread_atfork(clh_fork_prepare, clh_fork_parent, clh_fork_child); // Before flexguard_fork_child allocates nodes
+#endif
 #ifdef BPF
         deploy_bpf_code();
+        pthread_atfork(NULL, NULL, flexguard_fork_child);
 #else
         // Initialize things without BPF
-        qnode_allocation_array = malloc(MAX_NUMBER_THREADS * sizeof(flexguard_qnode_t));
+        qnode_allocation_array = alloc_on_demand(MAX_ARENA_THREADS * sizeof(flexguard_qnode_t));
 
         num_preempted_cs = malloc(sizeof(num_preempted_cs_t));
         *num_preempted_cs = 0;
+        num_preempted_readers = malloc(sizeof(num_preempted_cs_t));
+        *num_preempted_readers = 0;
+        num_preempted_threads = malloc(sizeof(num_preempted_cs_t));
+        *num_preempted_threads = 0;
+        lock_preempted_cs = alloc_on_demand(MAX_ARENA_LOCKS * sizeof(flexguard_lock_preempted_t));
 #endif
+        lock_next_free = alloc_on_demand(MAX_ARENA_LOCKS * sizeof(uint32_t));
+        pthread_key_create(&qnode_key, release_qnode);
         init_lock = 2;
     }
+}
+
+int flexguard_init(flexguard_lock_t *the_lock)
+{
+    the_lock->lock_value = 0;
+
+    flexguard_global_init();
+
+    // Ids of destroyed locks first, lock_count stops growing once ids run out
+    the_lock->id = pop_free_lock_id();
+    if (the_lock->id == FLEXGUARD_UNREGISTERED_LOCK && lock_count < MAX_ARENA_LOCKS - 1)
+        the_lock->id = atomic_fetch_add(&lock_count, 1) + 1;
+    if (the_lock->id >= MAX_ARENA_LOCKS)
+        the_lock->id = FLEXGUARD_UNREGISTERED_LOCK; // Use the process-wide count
+
+    if (the_lock->id != FLEXGUARD_UNREGISTERED_LOCK)
+        lock_preempted_cs[the_lock->id].count = 0; // Allocates the arena page before BPF updates it
 
 #ifdef HYBRID_TICKET
-    the_lock->ticket_lock.calling = 1;
+    the_lock->ticket_lock.calling = 0;
     the_lock->ticket_lock.next = 0;
 #elif defined(HYBRID_CLH)
-    *(the_lock->queue) = (flexguard_qnode_ptr)malloc(sizeof(flexguard_qnode_t)); // CLH keeps an empty node
-    (*the_lock->queue)->done = 1;
-    (*the_lock->queue)->pred = NULL;
+    the_lock->queue = clh_node_alloc(); // CLH keeps an empty node, handed over to threads
+    the_lock->queue->done = 1;
 #elif defined(HYBRID_MCS)
     the_lock->queue = NULL;
 #endif
 
+#ifdef FLEXGUARD_NUMA
+    the_lock->home = 0;
+    for (int i = 0; i < NUMA_NODES; i++)
+    {
+        the_lock->nodes[i].queue = NULL;
+        the_lock->nodes[i].grant = 0;
+        the_lock->nodes[i].batch_count = FLEXGUARD_NUMA_BATCH;
+    }
+#endif
+
     MEM_BARRIER;
     return 0;
 }
 
 void flexguard_destroy(flexguard_lock_t *the_lock)
 {
-    // Nothing to do
+#ifdef HYBRID_CLH
+    // The tail of a free queue is not the node of any thread
+    if (the_lock->queue)
+        clh_node_free(the_lock->queue);
+    the_lock->queue = NULL;
+#endif
+
+    if (the_lock->id != FLEXGUARD_UNREGISTERED_LOCK)
+        push_free_lock_id(the_lock->id);
+    the_lock->id = FLEXGUARD_UNREGISTERED_LOCK;
+}
+
+/*
+ *  Reader-Writer Locks
+ */
+
+int flexguard_rwlock_init(flexguard_rwlock_t *the_lock)
+{
+    the_lock->state = 0;
+    the_lock->write_locked = 0;
+    the_lock->writer_seq = 0;
+    the_lock->sleeping_readers = 0;
+    return flexguard_init(&the_lock->writer_lock);
+}
+
+void flexguard_rwlock_destroy(flexguard_rwlock_t *the_lock)
+{
+    flexguard_destroy(&the_lock->writer_lock);
+}
+
+static inline void rwlock_read_release(flexguard_rwlock_t *the_lock, flexguard_qnode_ptr qnode)
+{
+    // Last reader wakes up the writer if it went to sleep.
+    if (__sync_sub_and_fetch(&the_lock->state, RWLOCK_READER) == (RWLOCK_WRITER | RWLOCK_WRITER_SLEEPING))
+        futex_wake((void *)&the_lock->state, 1);
+
+#ifdef BPF
+    qnode->rcs_counter--;
+#endif
+}
+
+/*
+ * Wait for the current writer to release the lock, or until abstime if not NULL.
+ * Readers only sleep if a lock holder has been preempted.
+ */
+static inline int rwlock_wait_writer(flexguard_rwlock_t *the_lock, const struct timespec *abstime)
+{
+    uint32_t seq;
+    while (the_lock->state & RWLOCK_WRITER)
+    {
+        if (RWLOCK_BLOCKING_CONDITION(the_lock))
+        {
+            seq = the_lock->writer_seq;
+            __sync_fetch_and_add(&the_lock->sleeping_readers, 1);
+            if (the_lock->state & RWLOCK_WRITER)
+            {
+                if (abstime)
+                    futex_wait_until((void *)&the_lock->writer_seq, seq, abstime);
+                else
+                    futex_wait((void *)&the_lock->writer_seq, seq);
+            }
+            __sync_fetch_and_sub(&the_lock->sleeping_readers, 1);
+        }
+        else
+            PAUSE;
+
+        if ((the_lock->state & RWLOCK_WRITER) && TIMED_OUT(abstime))
+            return ETIMEDOUT;
+    }
+    return 0;
+}
+
+/*
+ * Wait for readers to leave once the writer bit is set, or until abstime if not NULL.
+ */
+static inline int rwlock_wait_readers(flexguard_rwlock_t *the_lock, const struct timespec *abstime)
+{
+    uint32_t state;
+    while ((state = the_lock->state) >= RWLOCK_READER)
+    {
+        if (RWLOCK_BLOCKING_CONDITION(the_lock))
+        {
+            if ((state & RWLOCK_WRITER_SLEEPING) ||
+                __sync_bool_compare_and_swap(&the_lock->state, state, state | RWLOCK_WRITER_SLEEPING))
+            {
+                if (abstime)
+                    futex_wait_until((void *)&the_lock->state, state | RWLOCK_WRITER_SLEEPING, abstime);
+                else
+                    futex_wait((void *)&the_lock->state, state | RWLOCK_WRITER_SLEEPING);
+            }
+        }
+        else
+            PAUSE;
+
+        if (the_lock->state >= RWLOCK_READER && TIMED_OUT(abstime))
+            return ETIMEDOUT;
+    }
+
+    if (state & RWLOCK_WRITER_SLEEPING)
+        __sync_fetch_and_and(&the_lock->state, ~RWLOCK_WRITER_SLEEPING);
+    return 0;
+}
+
+static inline int rwlock_rdlock_until(flexguard_rwlock_t *the_lock, const struct timespec *abstime)
+{
+    flexguard_qnode_ptr qnode = get_me();
+
+    while (1)
+    {
+        if ((the_lock->state & RWLOCK_WRITER) && rwlock_wait_writer(the_lock, abstime) != 0)
+            return ETIMEDOUT;
+
+#ifdef BPF
+        qnode->rcs_counter++;
+#endif
+        if (!(__sync_fetch_and_add(&the_lock->state, RWLOCK_READER) & RWLOCK_WRITER))
+            return 0;
+
+        // A writer came in first, leave room for it.
+        rwlock_read_release(the_lock, qnode);
+    }
+}
+
+void flexguard_rwlock_rdlock(flexguard_rwlock_t *the_lock)
+{
+    rwlock_rdlock_until(the_lock, NULL);
+}
+
+int flexguard_rwlock_timedrdlock(flexguard_rwlock_t *the_lock, const struct timespec *abstime)
+{
+    return rwlock_rdlock_until(the_lock, abstime);
+}
+
+int flexguard_rwlock_tryrdlock(flexguard_rwlock_t *the_lock)
+{
+    flexguard_qnode_ptr qnode = get_me();
+
+    if (the_lock->state & RWLOCK_WRITER)
+        return EBUSY;
+
+#ifdef BPF
+    qnode->rcs_counter++;
+#endif
+    if (!(__sync_fetch_and_add(&the_lock->state, RWLOCK_READER) & RWLOCK_WRITER))
+        return 0; // Success
+
+    rwlock_read_release(the_lock, qnode);
+    return EBUSY;
+}
+
+/*
+ * Clear the writer bit, wake up the readers waiting for it
+ * and release the writer lock.
+ */
+static inline void rwlock_write_release(flexguard_rwlock_t *the_lock)
+{
+    __sync_fetch_and_and(&the_lock->state, ~(RWLOCK_WRITER | RWLOCK_WRITER_SLEEPING));
+    __sync_fetch_and_add(&the_lock->writer_seq, 1);
+    if (the_lock->sleeping_readers)
+        futex_wake((void *)&the_lock->writer_seq, INT_MAX);
+
+    flexguard_unlock(&the_lock->writer_lock);
+}
+
+void flexguard_rwlock_wrlock(flexguard_rwlock_t *the_lock)
+{
+    flexguard_lock(&the_lock->writer_lock);
+
+    __sync_fetch_and_or(&the_lock->state, RWLOCK_WRITER);
+    rwlock_wait_readers(the_lock, NULL);
+    the_lock->write_locked = 1;
+}
+
+int flexguard_rwlock_timedwrlock(flexguard_rwlock_t *the_lock, const struct timespec *abstime)
+{
+    int ret = flexguard_timedlock(&the_lock->writer_lock, abstime);
+    if (ret != 0)
+        return ret;
+
+    __sync_fetch_and_or(&the_lock->state, RWLOCK_WRITER);
+    if (rwlock_wait_readers(the_lock, abstime) != 0)
+    {
+        // Readers kept out by the writer bit may proceed again.
+        rwlock_write_release(the_lock);
+        return ETIMEDOUT;
+    }
+    the_lock->write_locked = 1;
+    return 0;
+}
+
+int flexguard_rwlock_trywrlock(flexguard_rwlock_t *the_lock)
+{
+    if (flexguard_trylock(&the_lock->writer_lock) != 0)
+        return EBUSY;
+
+    if (__sync_bool_compare_and_swap(&the_lock->state, 0, RWLOCK_WRITER))
+    {
+        the_lock->write_locked = 1;
+        return 0; // Success
+    }
+
+    flexguard_unlock(&the_lock->writer_lock);
+    return EBUSY;
+}
+
+void flexguard_rwlock_unlock(flexguard_rwlock_t *the_lock)
+{
+    // No reader can hold the lock while it is write-locked.
+    if (!the_lock->write_locked)
+    {
+        rwlock_read_release(the_lock, get_me());
+        return;
+    }
+
+    the_lock->write_locked = 0;
+    rwlock_write_release(the_lock);
+}
+
+/*
+ *  Barriers
+ */
+
+int flexguard_barrier_init(flexguard_barrier_t *barrier, const int *attr, unsigned count)
+{
+    if (count == 0)
+        return EINVAL;
+
+    if (attr != NULL && *attr != PTHREAD_PROCESS_PRIVATE)
+    {
+        fprintf(stderr, "Only private barriers are supported.\n");
+        return EINVAL;
+    }
+
+    barrier->arrived = 0;
+    barrier->count = count;
+    barrier->seq = 0;
+    barrier->sleepers = 0;
+    barrier->leaving = 0;
+
+    flexguard_global_init();
+    MEM_BARRIER;
+    return 0;
+}
+
+#define BARRIER_DESTROYING (1U << 31) // In leaving, the last thread to leave wakes destroy
+
+/*
+ * Waits for the threads of the last generation to be done with the barrier,
+ * so that it can be freed as soon as any of them returned.
+ */
+int flexguard_barrier_destroy(flexguard_barrier_t *barrier)
+{
+    if (barrier->arrived != 0)
+        return EBUSY;
+
+    uint32_t leaving = __sync_or_and_fetch(&barrier->leaving, BARRIER_DESTROYING);
+    while (leaving != BARRIER_DESTROYING)
+    {
+        futex_wait((void *)&barrier->leaving, leaving);
+        leaving = barrier->leaving;
+    }
+    return 0;
+}
+
+static inline void barrier_leave(flexguard_barrier_t *barrier)
+{
+    if (__sync_sub_and_fetch(&barrier->leaving, 1) == BARRIER_DESTROYING)
+        futex_wake((void *)&barrier->leaving, 1);
+}
+
+int flexguard_barrier_wait(flexguard_barrier_t *barrier)
+{
+#ifdef BPF
+    get_me(); // Registered for its preemptions to be reported
+#endif
+
+    uint32_t seq = barrier->seq;
+
+    if (__sync_add_and_fetch(&barrier->arrived, 1) == barrier->count)
+    {
+        __sync_fetch_and_add(&barrier->leaving, barrier->count);
+        barrier->arrived = 0; // Before the new generation is visible
+        __sync_fetch_and_add(&barrier->seq, 1);
+        if (barrier->sleepers)
+            futex_wake((void *)&barrier->seq, INT_MAX);
+        barrier_leave(barrier);
+        return PTHREAD_BARRIER_SERIAL_THREAD;
+    }
+
+    while (barrier->seq == seq)
+    {
+        if (BARRIER_BLOCKING_CONDITION)
+        {
+            // Counted before the futex checks seq, so that the last thread sees it
+            __sync_fetch_and_add(&barrier->sleepers, 1);
+            futex_wait((void *)&barrier->seq, seq);
+            __sync_fetch_and_sub(&barrier->sleepers, 1);
+        }
+        else
+            PAUSE;
+    }
+
+    barrier_leave(barrier);
+    return 0;
+}
+
+/*
+ *  Semaphores
+ */
+
+int flexguard_sem_init(flexguard_sem_t *sem, int pshared, unsigned value)
+{
+    if (value > SEM_VALUE_MAX)
+        return EINVAL;
+
+    if (pshared)
+    {
+        fprintf(stderr, "Only private semaphores are supported.\n");
+        return ENOSYS;
+    }
+
+    sem->value = value;
+    sem->sleepers = 0;
+
+    flexguard_global_init();
+    MEM_BARRIER;
+    return 0;
+}
+
+int flexguard_sem_destroy(flexguard_sem_t *UNUSED(sem))
+{
+    return 0;
+}
+
+int flexguard_sem_trywait(flexguard_sem_t *sem)
+{
+    uint32_t value;
+    while ((value = sem->value) > 0)
+        if (__sync_bool_compare_and_swap(&sem->value, value, value - 1))
+            return 0;
+    return EAGAIN;
+}
+
+static inline int sem_wait_until(flexguard_sem_t *sem, const struct timespec *abstime)
+{
+    if (flexguard_sem_trywait(sem) == 0)
+        return 0;
+
+    if (abstime && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+        return EINVAL;
+
+    flexguard_global_init(); // For SEM_BLOCKING_CONDITION, the semaphore may not come from flexguard_sem_init
+
+    ticks start = getticks();
+    while (flexguard_sem_trywait(sem) != 0)
+    {
+        if (SEM_BLOCKING_CONDITION(sem) || getticks() - start > FLEXGUARD_SEM_MAX_SPIN)
+        {
+            // Counted before the futex checks value, so that posters see it
+            __sync_fetch_and_add(&sem->sleepers, 1);
+            int err = (abstime ? futex_wait_until((void *)&sem->value, 0, abstime)
+                               : futex_wait((void *)&sem->value, 0)) != 0
+                          ? errno
+                          : 0;
+            __sync_fetch_and_sub(&sem->sleepers, 1);
+
+            // Interrupted by a signal handler: returned to the caller, as by sem_wait(3)
+            if (err == ETIMEDOUT || err == EINTR)
+                return flexguard_sem_trywait(sem) == 0 ? 0 : err;
+        }
+        else
+        {
+            PAUSE;
+            if (TIMED_OUT(abstime))
+                return ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+int flexguard_sem_wait(flexguard_sem_t *sem)
+{
+    return sem_wait_until(sem, NULL);
+}
+
+int flexguard_sem_timedwait(flexguard_sem_t *sem, const struct timespec *abstime)
+{
+    return sem_wait_until(sem, abstime);
+}
+
+int flexguard_sem_post(flexguard_sem_t *sem)
+{
+    uint32_t value;
+    do
+    {
+        value = sem->value;
+        if (value == SEM_VALUE_MAX)
+            return EOVERFLOW;
+    } while (!__sync_bool_compare_and_swap(&sem->value, value, value + 1));
+
+    if (sem->sleepers)
+        futex_wake((void *)&sem->value, 1);
+    return 0;
+}
+
+int flexguard_sem_getvalue(flexguard_sem_t *sem, int *value)
+{
+    *value = sem->value;
+    return 0;
 }
 
 /*
@@ -406,38 +1736,94 @@ int flexguard_cond_init(flexguard_cond_t *cond)
 {
     cond->seq = 0;
     cond->target = 0;
+    cond->lock = NULL;
     return 0;
 }
 
-int flexguard_cond_wait(flexguard_cond_t *cond, flexguard_lock_t *the_lock)
+static inline void cond_futex_wait(flexguard_cond_t *cond, uint32_t seq, const struct timespec *abstime)
+{
+    if (abstime)
+        futex_wait_until(&cond->seq, seq, abstime);
+    else
+        futex_wait(&cond->seq, seq);
+}
+
+static inline bool cond_has_waiters(flexguard_cond_t *cond)
 {
+    return (int32_t)(cond->target - cond->seq) > 0;
+}
+
+/*
+ * The last waiter to leave forgets the lock, that may then be destroyed,
+ * for later broadcasts not to requeue to it.
+ */
+static inline int cond_leave(flexguard_cond_t *cond, int ret)
+{
+    if (!cond_has_waiters(cond))
+        cond->lock = NULL;
+    return ret;
+}
+
+static inline int cond_wait_until(flexguard_cond_t *cond, flexguard_lock_t *the_lock, const struct timespec *abstime)
+{
+    if (abstime && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+        return EINVAL;
+
     // No need for atomic operations, I have the lock
     uint32_t target = ++cond->target;
     uint32_t seq = cond->seq;
+    uint8_t woken = 0;
+    cond->lock = the_lock;
     flexguard_unlock(the_lock);
 
     while (target > seq)
     {
 #if defined(CONDVARS_BLOCK)
-        futex_wait(&cond->seq, seq);
+        cond_futex_wait(cond, seq, abstime);
+        woken = 1;
 #elif defined(CONDVARS_SPIN)
         PAUSE;
 #else
         if (BLOCKING_CONDITION(the_lock))
-            futex_wait(&cond->seq, seq);
+        {
+            cond_futex_wait(cond, seq, abstime);
+            woken = 1;
+        }
         else
             PAUSE;
 #endif
         seq = cond->seq;
+
+        if (target > seq && TIMED_OUT(abstime))
+        {
+            flexguard_lock_until(the_lock, NULL, woken);
+            if (target <= cond->seq)
+                return cond_leave(cond, 0); // Signaled in the meantime
+
+            /*
+             * Give the slot back. Later waiters keep theirs, so the slot is only
+             * removed if it is the last one, otherwise they are all woken up
+             * (spuriously) for no signal to be lost on it.
+             */
+            if (target == cond->target)
+                cond->target--;
+            else
+                flexguard_cond_broadcast(cond);
+            return cond_leave(cond, ETIMEDOUT);
+        }
     }
-    flexguard_lock(the_lock);
-    return 0;
+    flexguard_lock_until(the_lock, NULL, woken);
+    return cond_leave(cond, 0);
+}
+
+int flexguard_cond_wait(flexguard_cond_t *cond, flexguard_lock_t *the_lock)
+{
+    return cond_wait_until(cond, the_lock, NULL);
 }
 
 int flexguard_cond_timedwait(flexguard_cond_t *cond, flexguard_lock_t *the_lock, const struct timespec *ts)
 {
-    fprintf(stderr, "Timedwait not supported yet.\n");
-    exit(EXIT_FAILURE);
+    return cond_wait_until(cond, the_lock, ts);
 }
 
 int flexguard_cond_signal(flexguard_cond_t *cond)
@@ -449,11 +1835,22 @@ int flexguard_cond_signal(flexguard_cond_t *cond)
     return 0;
 }
 
+/*
+ * Wake a single waiter and requeue the others to the lock's futex, for them to
+ * be woken one at a time by unlocks instead of all rushing to the lock.
+ * Only done when waiters would sleep on the lock anyway.
+ */
 int flexguard_cond_broadcast(flexguard_cond_t *cond)
 {
-    cond->seq = cond->target;
+    if (!cond_has_waiters(cond))
+        return 0; // cond->lock may already be destroyed
+
+    uint32_t seq = cond->seq = cond->target;
 #ifndef CONDVARS_SPIN
-    futex_wake(&cond->seq, INT_MAX);
+    flexguard_lock_t *the_lock = cond->lock;
+    if (!the_lock || !COND_REQUEUE(the_lock) ||
+        futex_cmp_requeue(&cond->seq, seq, 1, INT_MAX, (void *)&the_lock->lock_value) < 0)
+        futex_wake(&cond->seq, INT_MAX);
 #endif
     return 0;
 }
@@ -462,5 +1859,6 @@ int flexguard_cond_destroy(flexguard_cond_t *cond)
 {
     cond->seq = 0;
     cond->target = 0;
+    cond->lock = NULL;
     return 0;
 }
\ No newline at end of file
@@ -30,10 +30,10 @@
 #include "futex.h"
 
 #ifdef DEBUG
-__thread uint8_t locked_thread = 0;
+static __thread uint8_t locked_thread = 0;
 
-int trylock_counter = 0;
-int lock_counter = 0;
+static int trylock_counter = 0;
+static int lock_counter = 0;
 #endif
 
 int futex_trylock(futex_lock_t *lock)
@@ -65,10 +65,12 @@ void futex_lock(futex_lock_t *lock)
   int state;
   if ((state = __sync_val_compare_and_swap(&lock->data, 0, 1)) != 0)
   {
+    LOCK_EVENT(slow_paths);
     if (state != 2)
       state = __sync_lock_test_and_set(&lock->data, 2);
     while (state != 0)
     {
+      LOCK_EVENT(sleeps);
       futex_wait((void *)&lock->data, 2);
       state = __sync_lock_test_and_set(&lock->data, 2);
     }
@@ -30,11 +30,12 @@
 
 #include "vmlinux.h"
 #include "platform_defs.h"
-#include "hybridlock_bpf.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
 #include <asm/processor-flags.h>
+#include "bpf_fixes.bpf.h"
+#include "hybridlock_bpf.h"
 
 #ifdef DEBUG
 #define DPRINT(args...) bpf_printk(args);
@@ -60,30 +61,42 @@ if (QNODE_FROM_ID(id)) {
 #define QNODE_ID(user_qnode) (user_qnode - qnode_allocation_starting_address)
 
 #define QNODE_FROM_ID(thread_id, dest) \
-	(thread_id >= 0 && thread_id < MAX_NUMBER_THREADS && (dest = &qnodes[thread_id]))
+	(thread_id >= 0 && thread_id < MAX_ARENA_THREADS && (dest = &qnodes[thread_id]))
 
 hybrid_addresses_t addresses;
 hybrid_qnode_ptr qnode_allocation_starting_address; // Filled by the lock init function with user-space pointer to qnode_allocation_array.
 
-volatile hybrid_lock_info_t lock_info[MAX_NUMBER_LOCKS];
-hybrid_qnode_t qnodes[MAX_NUMBER_THREADS];
+struct
+{
+	__uint(type, MAP_TYPE_ARENA);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(max_entries, ARENA_PAGES(HYBRID_ARENA_SIZE));
+} arena SEC(".maps");
+
+// Filled by user space with the arena tables once the arena is mapped.
+volatile hybrid_lock_info_t __arena *__arena_global lock_info;
+hybrid_qnode_ptr __arena_global qnodes;
 
 char _license[4] SEC("license") = "GPL";
 
+/*
+ * Thread id of registered threads. Keyed by task rather than by pid, which
+ * differs from gettid() in PID namespaces (containers).
+ */
 struct
 {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, u32);
+	__uint(type, MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
 	__type(value, int);
-	__uint(max_entries, MAX_NUMBER_THREADS);
 } nodes_map SEC(".maps");
 
 static int on_preemption(hybrid_qnode_ptr holder)
 {
 	int lock_id = holder->locking_id;
-	if (!(lock_id >= 0 && lock_id < MAX_NUMBER_LOCKS)) // Weird negative to please the verifier
-		return 1;																				 // Should never happen
-	volatile hybrid_lock_info_t *linfo = &lock_info[lock_id];
+	if (!(lock_id >= 0 && lock_id < MAX_ARENA_LOCKS)) // Weird negative to please the verifier
+		return 1;																				// Should never happen
+	volatile hybrid_lock_info_t __arena *linfo = &lock_info[lock_id];
 
 #ifdef HYBRID_EPOCH
 	// Prevent 2nd preemption of the same thread to re-enqueue the dummy_node.
@@ -172,26 +185,54 @@ static int on_preemption(hybrid_qnode_ptr holder)
 	return 0;
 }
 
+/*
+ * Run by each thread through BPF_PROG_RUN, in its own task context,
+ * to store its thread id in its task storage.
+ */
+SEC("syscall")
+int register_thread(hybrid_register_args_t *args)
+{
+	int *thread_id;
+
+	if (args->thread_id < 0 || args->thread_id >= MAX_ARENA_THREADS)
+		return 1;
+
+	thread_id = bpf_task_storage_get(&nodes_map, bpf_get_current_task_btf(), NULL, LOCAL_STORAGE_GET_F_CREATE);
+	if (!thread_id)
+		return 1;
+
+	*thread_id = args->thread_id;
+	return 0;
+}
+
+/*
+ * Run by exiting threads before their qnode is reused by another thread.
+ */
+SEC("syscall")
+int unregister_thread(void *args)
+{
+	bpf_task_storage_delete(&nodes_map, bpf_get_current_task_btf());
+	return 0;
+}
+
 SEC("tp_btf/sched_switch")
 int BPF_PROG(sched_switch_btf, bool preempt, struct task_struct *prev, struct task_struct *next)
 {
 	struct pt_regs *regs;
-	u32 key;
 	hybrid_qnode_ptr qnode;
 	int lock_id, *thread_id;
 
 	/*
 	 * Clear preempted status of next thread.
 	 */
-	key = next->pid;
-	thread_id = bpf_map_lookup_elem(&nodes_map, &key);
+	thread_id = bpf_task_storage_get(&nodes_map, next, NULL, 0);
 	if (thread_id && QNODE_FROM_ID(*thread_id, qnode))
 	{
 		qnode->is_running = 1;
 
 #ifndef HYBRID_EPOCH
 		lock_id = qnode->locking_id;
-		if (lock_id >= 0 && lock_id < MAX_NUMBER_LOCKS && qnode->is_holder_preempted)
+		if (lock_id >= 0 && lock_id < MAX_ARENA_LOCKS && qnode->is_holder_preempted)
 		{
 			DPRINT("%s (%d) rescheduled after %s (%d)", next->comm, next->pid, prev->comm, prev->pid);
 			lock_info[lock_id].preempted_at = (__LONG_MAX__ * 2UL + 1UL); // ULONG_MAX
@@ -209,8 +250,7 @@ int BPF_PROG(sched_switch_btf, bool preempt, struct task_struct *prev, struct ta
 	/*
 	 * Retrieve prev's qnode.
 	 */
-	key = prev->pid;
-	thread_id = bpf_map_lookup_elem(&nodes_map, &key);
+	thread_id = bpf_task_storage_get(&nodes_map, prev, NULL, 0);
 	if (!thread_id || !QNODE_FROM_ID(*thread_id, qnode))
 		return 0;
 
@@ -220,7 +260,7 @@ int BPF_PROG(sched_switch_btf, bool preempt, struct task_struct *prev, struct ta
 	/*
 	 * Ignore preemption if the thread was not locking.
 	 */
-	if (lock_id < 0 || lock_id >= MAX_NUMBER_LOCKS)
+	if (lock_id < 0 || lock_id >= MAX_ARENA_LOCKS)
 		return 0;
 
 	/*
@@ -30,6 +30,7 @@
 #include "hybridlock.h"
 
 #ifdef BPF
+#include <bpf/bpf.h>
 #include "hybridlock.skel.h"
 
 #ifndef HYBRID_EPOCH
@@ -53,12 +54,100 @@ hybrid_qnode_ptr qnode_allocation_array;
 
 hybrid_lock_info_t *lock_info;
 __thread int thread_id = -1;
+static pthread_key_t qnode_key;
+
+/*
+ * Lock-free stack of the qnodes released by exited threads.
+ * Low half: id + 1 of the top qnode (0 if empty), high half: ABA tag bumped on pop.
+ */
+static volatile uint64_t free_qnodes = 0;
+
+/*
+ * Same stack for the ids of destroyed locks, lock_next_free[id] holding the
+ * id + 1 of the next one.
+ */
+static volatile uint64_t free_lock_ids = 0;
+static volatile uint32_t *lock_next_free;
 
 #ifdef BPF
 hybrid_addresses_t *addresses;
-struct bpf_map *nodes_map;
+int register_thread_fd;
+int unregister_thread_fd;
+#endif
+
+static void push_free_qnode(int id)
+{
+    uint64_t head, new;
+    do
+    {
+        head = free_qnodes;
+        qnode_allocation_array[id].next_free = (uint32_t)head;
+        new = (head & ~0xFFFFFFFFULL) | (uint32_t)(id + 1);
+    } while (!__sync_bool_compare_and_swap(&free_qnodes, head, new));
+}
+
+static int pop_free_qnode()
+{
+    uint64_t head, new;
+    uint32_t top;
+    do
+    {
+        head = free_qnodes;
+        top = (uint32_t)head;
+        if (top == 0)
+            return -1;
+        new = (((head >> 32) + 1) << 32) | qnode_allocation_array[top - 1].next_free;
+    } while (!__sync_bool_compare_and_swap(&free_qnodes, head, new));
+
+    return top - 1;
+}
+
+static void push_free_lock_id(int id)
+{
+    uint64_t head, new;
+    do
+    {
+        head = free_lock_ids;
+        lock_next_free[id] = (uint32_t)head;
+        new = (head & ~0xFFFFFFFFULL) | (uint32_t)(id + 1);
+    } while (!__sync_bool_compare_and_swap(&free_lock_ids, head, new));
+}
+
+static int pop_free_lock_id()
+{
+    uint64_t head, new;
+    uint32_t top;
+    do
+    {
+        head = free_lock_ids;
+        top = (uint32_t)head;
+        if (top == 0)
+            return -1;
+        new = (((head >> 32) + 1) << 32) | lock_next_free[top - 1];
+    } while (!__sync_bool_compare_and_swap(&free_lock_ids, head, new));
+
+    return top - 1;
+}
+
+/*
+ * TLS destructor giving the qnode of an exiting thread back for reuse.
+ */
+static void release_qnode(void *UNUSED(value))
+{
+    if (thread_id < 0)
+        return;
+
+#ifdef BPF
+    LIBBPF_OPTS(bpf_test_run_opts, opts);
+    int err = bpf_prog_test_run_opts(unregister_thread_fd, &opts);
+    if (err)
+        fprintf(stderr, "Failed to unregister thread from BPF: %d\n", err);
 #endif
 
+    push_free_qnode(thread_id);
+    thread_id = -1;
+}
+
 #ifndef HYBRID_EPOCH
 int global_blocking_id = 0;
 #endif
@@ -67,15 +156,19 @@ static hybrid_qnode_ptr get_me()
 {
     if (UNLIKELY(thread_id < 0))
     {
-        thread_id = atomic_fetch_add(&thread_count, 1);
-        CHECK_NUMBER_THREADS_FATAL(thread_id);
+        thread_id = pop_free_qnode();
+        if (thread_id < 0)
+            thread_id = atomic_fetch_add(&thread_count, 1);
+        CHECK_NUMBER_ARENA_THREADS_FATAL(thread_id);
+        pthread_setspecific(qnode_key, (void *)1); // Non-NULL for the destructor to run
 
 #ifdef BPF
-        // Register thread in BPF map
-        __u32 tid = gettid();
-        int err = bpf_map__update_elem(nodes_map, &tid, sizeof(tid), &thread_id, sizeof(thread_id), BPF_ANY);
-        if (err)
-            fprintf(stderr, "Failed to register thread with BPF: %d\n", err);
+        // Register thread in its BPF task storage
+        hybrid_register_args_t args = {.thread_id = thread_id};
+        LIBBPF_OPTS(bpf_test_run_opts, opts, .ctx_in = &args, .ctx_size_in = sizeof(args));
+        int err = bpf_prog_test_run_opts(register_thread_fd, &opts);
+        if (err || opts.retval)
+            fprintf(stderr, "Failed to register thread with BPF: %d\n", err ? err : (int)opts.retval);
 #endif
 
         hybrid_qnode_ptr qnode = &qnode_allocation_array[thread_id];
@@ -532,10 +625,6 @@ static void deploy_bpf_code()
     addresses->unlock_end_b = &bhl_unlock_end_b;
 #endif
 
-    lock_info = skel->bss->lock_info;
-    qnode_allocation_array = skel->bss->qnodes;
-    skel->bss->qnode_allocation_starting_address = qnode_allocation_array;
-
     // Load BPF skeleton
     err = hybridlock_bpf__load(skel);
     if (err)
@@ -545,8 +634,25 @@ static void deploy_bpf_code()
         exit(EXIT_FAILURE);
     }
 
-    // Store map
-    nodes_map = skel->maps.nodes_map;
+    // Store registration programs
+    register_thread_fd = bpf_program__fd(skel->progs.register_thread);
+    unregister_thread_fd = bpf_program__fd(skel->progs.unregister_thread);
+
+    // Tables live in the arena, mapped by libbpf on load
+    size_t arena_size;
+    void *arena = bpf_map__initial_value(skel->maps.arena, &arena_size);
+    if (!arena || arena_size < HYBRID_ARENA_SIZE)
+    {
+        fprintf(stderr, "Failed to map BPF arena\n");
+        hybridlock_bpf__destroy(skel);
+        exit(EXIT_FAILURE);
+    }
+
+    qnode_allocation_array = arena + HYBRID_ARENA_QNODES_OFFSET;
+    lock_info = arena + HYBRID_ARENA_LOCKS_OFFSET;
+    skel->arena->qnodes = qnode_allocation_array;
+    skel->arena->lock_info = lock_info;
+    skel->bss->qnode_allocation_starting_address = qnode_allocation_array;
 
     // Attach BPF skeleton
     err = hybridlock_bpf__attach(skel);
@@ -561,15 +667,6 @@ static void deploy_bpf_code()
 
 int hybridlock_init(hybridlock_lock_t *the_lock)
 {
-    the_lock->id = atomic_fetch_add(&lock_count, 1);
-    if (the_lock->id >= MAX_NUMBER_LOCKS)
-    {
-        fprintf(stderr, "Too many locks. Increase MAX_NUMBER_LOCKS in platform_defs.h.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    the_lock->blocking_id = 0;
-
     static volatile uint8_t init_lock = 0;
     if (exactly_once(&init_lock) == 0)
     {
@@ -577,12 +674,26 @@ int hybridlock_init(hybridlock_lock_t *the_lock)
         deploy_bpf_code();
 #else
         // Initialize things without BPF
-        qnode_allocation_array = malloc(MAX_NUMBER_THREADS * sizeof(hybrid_qnode_t));
-        lock_info = malloc(MAX_NUMBER_LOCKS * sizeof(hybrid_lock_info_t));
+        qnode_allocation_array = alloc_on_demand(MAX_ARENA_THREADS * sizeof(hybrid_qnode_t));
+        lock_info = alloc_on_demand(MAX_ARENA_LOCKS * sizeof(hybrid_lock_info_t));
 #endif
+        lock_next_free = alloc_on_demand(MAX_ARENA_LOCKS * sizeof(uint32_t));
+        pthread_key_create(&qnode_key, release_qnode);
         init_lock = 2;
     }
 
+    // Ids of destroyed locks first
+    the_lock->id = pop_free_lock_id();
+    if (the_lock->id < 0)
+        the_lock->id = atomic_fetch_add(&lock_count, 1);
+    if (the_lock->id >= MAX_ARENA_LOCKS)
+    {
+        fprintf(stderr, "Too many locks. Increase MAX_ARENA_LOCKS in platform_defs.h.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    the_lock->blocking_id = 0;
+
 #ifdef HYBRID_MCS
     the_lock->queue_lock = &lock_info[the_lock->id].queue_lock;
 
@@ -629,7 +740,20 @@ int hybridlock_init(hybridlock_lock_t *the_lock)
 
 void hybridlock_destroy(hybridlock_lock_t *the_lock)
 {
-    // Nothing to do
+    // Reset for the next lock given the id, the BPF program may read the entry meanwhile
+    hybrid_lock_info_t *info = &lock_info[the_lock->id];
+#ifdef HYBRID_MCS
+    info->queue_lock = NULL;
+#ifdef HYBRID_EPOCH
+    info->dummy_node_enqueued = 0;
+    info->blocking_nodes = 0;
+#endif
+#endif
+#ifndef HYBRID_EPOCH
+    info->preempted_at = ULONG_MAX;
+#endif
+
+    push_free_lock_id(the_lock->id);
 }
 
 #ifdef TRACING
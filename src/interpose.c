@@ -26,11 +26,15 @@
 #endif
 
 #include "interpose.h"
+#include "slab.h"
 
 #include <assert.h>
 #include <atomic_ops.h>
 #include <dlfcn.h>
+#include <limits.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
 
 #if USE_REAL_PTHREAD == 1
 int (*REAL(pthread_mutex_init))(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) __attribute__((aligned(CACHE_LINE_SIZE)));
@@ -47,6 +51,16 @@ int (*REAL(pthread_cond_signal))(pthread_cond_t *cond) __attribute__((aligned(CA
 int (*REAL(pthread_cond_broadcast))(pthread_cond_t *cond) __attribute__((aligned(CACHE_LINE_SIZE)));
 #endif
 
+#if INTERPOSE_SEMAPHORE
+int (*REAL(sem_init))(sem_t *sem, int pshared, unsigned int value);
+int (*REAL(sem_destroy))(sem_t *sem);
+int (*REAL(sem_wait))(sem_t *sem);
+int (*REAL(sem_trywait))(sem_t *sem);
+int (*REAL(sem_timedwait))(sem_t *sem, const struct timespec *abstime);
+int (*REAL(sem_post))(sem_t *sem);
+int (*REAL(sem_getvalue))(sem_t *sem, int *value);
+#endif
+
 #if TEST_INTERPOSE == 1
 int test_interpose_counter = 42;
 #define TEST_INTERPOSITION() \
@@ -55,6 +69,360 @@ int test_interpose_counter = 42;
 #define TEST_INTERPOSITION()
 #endif
 
+#ifdef FLEXGUARD_PROFILE
+/*
+ * Per-mutex contention profile.
+ * Each thread counts in its own cache-line-sized records, indexed by mutex id.
+ * Buffers of exited threads are merged into exited_profile and recycled.
+ * The CSV is written at exit and on SIGUSR2, to FLEXGUARD_PROFILE_OUTPUT or stderr.
+ * Only mutexes are profiled, not rwlocks, spinlocks or semaphores, and
+ * INTERPOSE_EMBEDDED builds have no room for the mutex id.
+ * Contended acquisitions and slow paths only count for locks reporting LOCK_EVENTs.
+ */
+#define PROFILE_CHUNK_SIZE 256
+#define PROFILE_CHUNKS 4096 // Up to 1M mutexes
+
+typedef union
+{
+  struct
+  {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t slow_paths;
+    uint64_t sleeps;
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+    ticks acquired_at;
+  };
+  uint8_t padding[CACHE_LINE_SIZE];
+} profile_record_t;
+
+typedef struct profile_buffer_t
+{
+  profile_record_t *volatile chunks[PROFILE_CHUNKS];
+  struct profile_buffer_t *next;      // All buffers
+  struct profile_buffer_t *next_free; // Recycled buffers
+} profile_buffer_t;
+
+typedef struct
+{
+  void *address;
+  const char *object; // Init call site, as object+offset
+  uintptr_t offset;
+} profile_mutex_t;
+
+static profile_mutex_t *volatile profile_mutexes[PROFILE_CHUNKS];
+static volatile int profile_mutex_count = 0;
+
+static profile_buffer_t *volatile profile_buffers = NULL;
+static profile_buffer_t *profile_free_buffers = NULL;
+static volatile uint8_t profile_free_lock = 0;
+static profile_buffer_t exited_profile;
+
+static pthread_key_t profile_key;
+static __thread profile_buffer_t *profile_me __attribute__((tls_model("initial-exec")));
+
+/*
+ * Chunk of index in chunks, allocated on first use.
+ */
+static void *profile_chunk(void *volatile *chunks, int index, size_t size)
+{
+  void *chunk = chunks[index / PROFILE_CHUNK_SIZE];
+  if (LIKELY(chunk != NULL))
+    return chunk;
+
+  chunk = aligned_alloc(CACHE_LINE_SIZE, size * PROFILE_CHUNK_SIZE);
+  memset(chunk, 0, size * PROFILE_CHUNK_SIZE);
+  void *curr = __sync_val_compare_and_swap(&chunks[index / PROFILE_CHUNK_SIZE], NULL, chunk);
+  if (curr)
+  {
+    free(chunk);
+    return curr;
+  }
+  return chunk;
+}
+
+static int profile_register(void *raw_lock, void *caller)
+{
+  int id = __sync_fetch_and_add(&profile_mutex_count, 1);
+  if (id >= PROFILE_CHUNKS * PROFILE_CHUNK_SIZE)
+    return -1;
+
+  profile_mutex_t *mutex = (profile_mutex_t *)profile_chunk((void *volatile *)profile_mutexes, id, sizeof(profile_mutex_t));
+  mutex = &mutex[id % PROFILE_CHUNK_SIZE];
+  mutex->address = raw_lock;
+  mutex->offset = (uintptr_t)caller;
+
+  Dl_info info;
+  if (caller && dladdr(caller, &info) && info.dli_fname)
+  {
+    const char *name = strrchr(info.dli_fname, '/');
+    mutex->object = name ? name + 1 : info.dli_fname;
+    mutex->offset -= (uintptr_t)info.dli_fbase;
+  }
+
+  return id;
+}
+
+static profile_buffer_t *profile_thread_init()
+{
+  profile_buffer_t *buffer = NULL;
+
+  while (tas_uint8(&profile_free_lock))
+    RAW_PAUSE;
+  if (profile_free_buffers)
+  {
+    buffer = profile_free_buffers;
+    profile_free_buffers = buffer->next_free;
+  }
+  profile_free_lock = 0;
+
+  if (!buffer)
+  {
+    buffer = (profile_buffer_t *)calloc(1, sizeof(profile_buffer_t));
+    do
+      buffer->next = profile_buffers;
+    while (!__sync_bool_compare_and_swap(&profile_buffers, buffer->next, buffer));
+  }
+
+  pthread_setspecific(profile_key, buffer);
+  return buffer;
+}
+
+/*
+ * Merge the counts of an exiting thread and recycle its buffer.
+ */
+static void profile_thread_exit(void *value)
+{
+  profile_buffer_t *buffer = (profile_buffer_t *)value;
+
+  for (int c = 0; c < PROFILE_CHUNKS; c++)
+  {
+    profile_record_t *chunk = buffer->chunks[c];
+    if (!chunk)
+      continue;
+
+    for (int i = 0; i < PROFILE_CHUNK_SIZE; i++)
+    {
+      profile_record_t *record = &chunk[i];
+      if (!record->acquisitions)
+        continue;
+
+      profile_record_t *total = (profile_record_t *)profile_chunk((void *volatile *)exited_profile.chunks, c * PROFILE_CHUNK_SIZE, sizeof(profile_record_t));
+      total = &total[i];
+      __sync_fetch_and_add(&total->acquisitions, record->acquisitions);
+      __sync_fetch_and_add(&total->contended, record->contended);
+      __sync_fetch_and_add(&total->slow_paths, record->slow_paths);
+      __sync_fetch_and_add(&total->sleeps, record->sleeps);
+      __sync_fetch_and_add(&total->wait_cycles, record->wait_cycles);
+      __sync_fetch_and_add(&total->hold_cycles, record->hold_cycles);
+    }
+    memset(chunk, 0, sizeof(profile_record_t) * PROFILE_CHUNK_SIZE);
+  }
+
+  while (tas_uint8(&profile_free_lock))
+    RAW_PAUSE;
+  buffer->next_free = profile_free_buffers;
+  profile_free_buffers = buffer;
+  profile_free_lock = 0;
+
+  profile_me = NULL;
+}
+
+static inline profile_record_t *profile_record(void *raw_lock)
+{
+  int id = CAST_TO_LOCK(raw_lock)->profile_id;
+  if (UNLIKELY(id < 0))
+    return NULL;
+
+  if (UNLIKELY(!profile_me))
+    profile_me = profile_thread_init();
+
+  profile_record_t *chunk = (profile_record_t *)profile_chunk((void *volatile *)profile_me->chunks, id, sizeof(profile_record_t));
+  return &chunk[id % PROFILE_CHUNK_SIZE];
+}
+
+static inline void profile_acquired(void *raw_lock, ticks start, lock_events_t *events)
+{
+  profile_record_t *record = profile_record(raw_lock);
+  if (!record)
+    return;
+
+  ticks now = getticks();
+  uint64_t slow_paths = lock_events.slow_paths - events->slow_paths;
+
+  record->acquisitions++;
+  record->contended += slow_paths > 0;
+  record->slow_paths += slow_paths;
+  record->sleeps += lock_events.sleeps - events->sleeps;
+  record->wait_cycles += now - start;
+  record->acquired_at = now;
+}
+
+static inline void profile_released(void *raw_lock)
+{
+  profile_record_t *record = profile_record(raw_lock);
+  if (record && record->acquired_at)
+  {
+    record->hold_cycles += getticks() - record->acquired_at;
+    record->acquired_at = 0;
+  }
+}
+
+/*
+ * Reacquired after a condition wait, not counted as an acquisition.
+ */
+static inline void profile_reacquired(void *raw_lock)
+{
+  profile_record_t *record = profile_record(raw_lock);
+  if (record)
+    record->acquired_at = getticks();
+}
+
+static void profile_sum(profile_record_t *total, profile_buffer_t *buffer, int id)
+{
+  profile_record_t *chunk = buffer->chunks[id / PROFILE_CHUNK_SIZE];
+  if (!chunk)
+    return;
+
+  profile_record_t *record = &chunk[id % PROFILE_CHUNK_SIZE];
+  total->acquisitions += record->acquisitions;
+  total->contended += record->contended;
+  total->slow_paths += record->slow_paths;
+  total->sleeps += record->sleeps;
+  total->wait_cycles += record->wait_cycles;
+  total->hold_cycles += record->hold_cycles;
+}
+
+/*
+ * Line of the CSV, formatted by hand as snprintf is not async-signal-safe.
+ */
+typedef struct
+{
+  char data[512];
+  int len;
+} profile_line_t;
+
+static void profile_put(profile_line_t *line, const char *text)
+{
+  while (*text && line->len < sizeof(line->data))
+    line->data[line->len++] = *text++;
+}
+
+static void profile_put_uint(profile_line_t *line, uint64_t value, int base)
+{
+  char digits[24];
+  int i = sizeof(digits) - 1;
+
+  digits[i] = '\0';
+  do
+    digits[--i] = "0123456789abcdef"[value % base];
+  while (value /= base);
+
+  if (base == 16)
+    profile_put(line, "0x");
+  profile_put(line, &digits[i]);
+}
+
+static char profile_output[PATH_MAX]; // FLEXGUARD_PROFILE_OUTPUT, read at init
+
+/*
+ * Only uses async-signal-safe functions, to be callable from the SIGUSR2 handler.
+ * Counts of running threads are read without synchronization.
+ */
+static void profile_dump()
+{
+  int fd = profile_output[0] ? open(profile_output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDERR_FILENO;
+  if (fd < 0)
+    return;
+
+  profile_line_t line = {.len = 0};
+  profile_put(&line, "id,address,site,acquisitions,contended,slow_paths,sleeps,wait_cycles,hold_cycles\n");
+  write(fd, line.data, line.len);
+
+  int count = profile_mutex_count;
+  if (count > PROFILE_CHUNKS * PROFILE_CHUNK_SIZE)
+    count = PROFILE_CHUNKS * PROFILE_CHUNK_SIZE;
+
+  for (int id = 0; id < count; id++)
+  {
+    profile_mutex_t *mutex = profile_mutexes[id / PROFILE_CHUNK_SIZE];
+    if (!mutex)
+      continue;
+    mutex = &mutex[id % PROFILE_CHUNK_SIZE];
+
+    profile_record_t total = {0};
+    for (profile_buffer_t *buffer = profile_buffers; buffer; buffer = buffer->next)
+      profile_sum(&total, buffer, id);
+    profile_sum(&total, &exited_profile, id);
+
+    if (!total.acquisitions)
+      continue;
+
+    line.len = 0;
+    profile_put_uint(&line, id, 10);
+    profile_put(&line, ",");
+    profile_put_uint(&line, (uintptr_t)mutex->address, 16);
+    profile_put(&line, ",");
+
+    if (mutex->object)
+    {
+      profile_put(&line, mutex->object);
+      profile_put(&line, "+");
+      profile_put_uint(&line, mutex->offset, 16);
+    }
+    else if (mutex->offset)
+      profile_put_uint(&line, mutex->offset, 16);
+    else
+      profile_put(&line, "static"); // Static initializer
+
+    uint64_t values[] = {total.acquisitions, total.contended, total.slow_paths,
+                         total.sleeps, total.wait_cycles, total.hold_cycles};
+    for (int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+      profile_put(&line, ",");
+      profile_put_uint(&line, values[i], 10);
+    }
+    profile_put(&line, "\n");
+    write(fd, line.data, line.len);
+  }
+
+  if (fd != STDERR_FILENO)
+    close(fd);
+}
+
+static void profile_signal_handler(int UNUSED(signal))
+{
+  profile_dump();
+}
+
+#define PROFILE_START()                      \
+  lock_events_t profile_events = lock_events; \
+  ticks profile_start = getticks()
+#define PROFILE_ACQUIRED(raw_lock) profile_acquired(raw_lock, profile_start, &profile_events)
+#define PROFILE_RELEASED(raw_lock) profile_released(raw_lock)
+#define PROFILE_REACQUIRED(raw_lock) profile_reacquired(raw_lock)
+#else
+#define PROFILE_START()
+#define PROFILE_ACQUIRED(raw_lock)
+#define PROFILE_RELEASED(raw_lock)
+#define PROFILE_REACQUIRED(raw_lock)
+#endif
+
+/*
+ * Lock objects are allocated from per-thread slabs
+ */
+static slab_cache_t cond_cache = SLAB_CACHE_INITIALIZER(sizeof(libslock_cond_t));
+#ifndef INTERPOSE_EMBEDDED
+static slab_cache_t lock_cache = SLAB_CACHE_INITIALIZER(sizeof(libslock_t));
+#if INTERPOSE_RWLOCK
+static slab_cache_t rwlock_cache = SLAB_CACHE_INITIALIZER(sizeof(libslock_rwlock_t));
+#endif
+#endif
+#if INTERPOSE_BARRIERS
+static slab_cache_t barrier_cache = SLAB_CACHE_INITIALIZER(sizeof(libslock_barrier_t));
+#endif
+
 static void __attribute__((constructor)) REAL(interpose_init)(void)
 {
   static volatile uint8_t init_lock = 0;
@@ -75,76 +443,220 @@ static void __attribute__((constructor)) REAL(interpose_init)(void)
   LOAD_FUNC(pthread_cond_signal, 1);
 #endif
 
+#if INTERPOSE_SEMAPHORE
+  LOAD_FUNC(sem_init, 1);
+  LOAD_FUNC(sem_destroy, 1);
+  LOAD_FUNC(sem_wait, 1);
+  LOAD_FUNC(sem_trywait, 1);
+  LOAD_FUNC(sem_timedwait, 1);
+  LOAD_FUNC(sem_post, 1);
+  LOAD_FUNC(sem_getvalue, 1);
+#endif
+
+#ifdef FLEXGUARD_PROFILE
+  const char *output = getenv("FLEXGUARD_PROFILE_OUTPUT");
+  if (output)
+    strncpy(profile_output, output, sizeof(profile_output) - 1);
+  pthread_key_create(&profile_key, profile_thread_exit);
+  signal(SIGUSR2, profile_signal_handler);
+#endif
+
   __sync_synchronize();
   init_lock = 2;
 }
 
 static void __attribute__((destructor)) REAL(interpose_exit)(void)
 {
+#ifdef FLEXGUARD_PROFILE
+  profile_dump();
+#endif
 }
 
 /*
  * Lock functions
  */
-static int interpose_lock_init(void *raw_lock, bool force)
+/*
+ * Recursive and error-check mutexes track their owner, by a per-thread id
+ * cheaper to get than gettid(2). Ids of exited threads are never reused.
+ */
+static volatile int self_count = 0;
+static __thread int self_id __attribute__((tls_model("initial-exec")));
+
+static inline int get_self()
+{
+  if (UNLIKELY(!self_id))
+    self_id = __sync_add_and_fetch(&self_count, 1);
+  return self_id;
+}
+
+static inline bool tracks_owner(lock_as_t *lock)
+{
+  int type = lock->type & MUTEX_KIND_MASK;
+  return type == PTHREAD_MUTEX_RECURSIVE || type == PTHREAD_MUTEX_ERRORCHECK;
+}
+
+/*
+ * caller initialized the lock, type is its pthread mutex type or -1.
+ */
+static int interpose_lock_init(void *raw_lock, void *caller, int type, bool force)
 {
   lock_as_t *lock = CAST_TO_LOCK(raw_lock);
 
+  if (force)
+  {
+    lock->type = type;
+    lock->owner = 0;
+    lock->count = 0;
+  }
+
+#ifdef INTERPOSE_EMBEDDED
+  if (!force)
+    return 0; // Zeroed locks are ready to use
+  return libslock_init_for(&lock->lock, raw_lock, caller, type);
+#else
   if (force)
     lock->status = 0;
 
   if (exactly_once(&lock->status) != 0)
     return 0;
 
-  lock->lock = (libslock_t *)malloc((sizeof(libslock_t)));
+  lock->lock = (libslock_t *)slab_alloc(&lock_cache);
+#ifdef FLEXGUARD_PROFILE
+  lock->profile_id = profile_register(raw_lock, caller);
+#endif
 
-  int res = libslock_init(lock->lock);
+  int res = libslock_init_for(lock->lock, raw_lock, caller, type);
   lock->status = 2;
   return res;
+#endif
+}
+
+/*
+ * Lock of a pthread object, initialized on first use.
+ */
+static inline libslock_t *get_lock(void *raw_lock)
+{
+#ifdef INTERPOSE_EMBEDDED
+  return (libslock_t *)raw_lock;
+#else
+  lock_as_t *lock = CAST_TO_LOCK(raw_lock);
+
+  if (UNLIKELY(lock->status != 2))
+    interpose_lock_init(raw_lock, NULL, lock->type & MUTEX_KIND_MASK, false); // Static initializer
+
+  return lock->lock;
+#endif
 }
 
 static int interpose_lock_destroy(void *raw_lock)
 {
+#ifdef INTERPOSE_EMBEDDED
+  libslock_destroy((libslock_t *)raw_lock);
+  return 0;
+#else
   lock_as_t *lock = CAST_TO_LOCK(raw_lock);
   if (LIKELY(lock->status == 2))
   {
     libslock_destroy(lock->lock);
-    free(lock->lock);
+    slab_free(&lock_cache, lock->lock);
     lock->status = 0;
   }
 
   return 0;
+#endif
 }
 
-static int interpose_lock_lock(void *raw_lock)
+/*
+ * Lock already held by the calling thread: nested acquisition of a recursive
+ * mutex, without atomic operation, or error.
+ */
+static inline int relock(lock_as_t *lock, int error)
 {
-  lock_as_t *lock = CAST_TO_LOCK(raw_lock);
+  if ((lock->type & MUTEX_KIND_MASK) != PTHREAD_MUTEX_RECURSIVE)
+    return error;
+  if (UNLIKELY(lock->count == UINT32_MAX))
+    return EAGAIN;
 
-  if (UNLIKELY(lock->status != 2))
-    interpose_lock_init(raw_lock, false);
+  lock->count++;
+  return 0;
+}
+
+static inline void set_owner(lock_as_t *lock)
+{
+  lock->owner = get_self();
+  lock->count = 1;
+}
 
-  libslock_lock(lock->lock);
+static int interpose_lock_lock(void *raw_lock)
+{
+  lock_as_t *mutex = CAST_TO_LOCK(raw_lock);
+  libslock_t *lock = get_lock(raw_lock);
+  bool owned = tracks_owner(mutex);
+  if (UNLIKELY(owned) && mutex->owner == get_self())
+    return relock(mutex, EDEADLK);
+
+  PROFILE_START();
+  libslock_lock(lock);
+  PROFILE_ACQUIRED(raw_lock);
+
+  if (UNLIKELY(owned))
+    set_owner(mutex);
   return 0;
 }
 
 static int interpose_lock_trylock(void *raw_lock)
 {
-  lock_as_t *lock = CAST_TO_LOCK(raw_lock);
-
-  if (UNLIKELY(lock->status != 2))
-    interpose_lock_init(raw_lock, false);
+  lock_as_t *mutex = CAST_TO_LOCK(raw_lock);
+  libslock_t *lock = get_lock(raw_lock);
+  bool owned = tracks_owner(mutex);
+  if (UNLIKELY(owned) && mutex->owner == get_self())
+    return relock(mutex, EBUSY);
+
+  PROFILE_START();
+  int res = libslock_trylock(lock);
+  if (res == 0)
+  {
+    PROFILE_ACQUIRED(raw_lock);
+    if (UNLIKELY(owned))
+      set_owner(mutex);
+  }
+  return res;
+}
 
-  return libslock_trylock(lock->lock);
+static int interpose_lock_timedlock(void *raw_lock, const struct timespec *abstime)
+{
+  lock_as_t *mutex = CAST_TO_LOCK(raw_lock);
+  libslock_t *lock = get_lock(raw_lock);
+  bool owned = tracks_owner(mutex);
+  if (UNLIKELY(owned) && mutex->owner == get_self())
+    return relock(mutex, EDEADLK);
+
+  PROFILE_START();
+  int res = libslock_timedlock(lock, abstime);
+  if (res == 0)
+  {
+    PROFILE_ACQUIRED(raw_lock);
+    if (UNLIKELY(owned))
+      set_owner(mutex);
+  }
+  return res;
 }
 
 static int interpose_lock_unlock(void *raw_lock)
 {
-  lock_as_t *lock = CAST_TO_LOCK(raw_lock);
-
-  if (UNLIKELY(lock->status != 2))
-    interpose_lock_init(raw_lock, false);
+  lock_as_t *mutex = CAST_TO_LOCK(raw_lock);
+  libslock_t *lock = get_lock(raw_lock);
+  if (UNLIKELY(tracks_owner(mutex)))
+  {
+    if (mutex->owner != get_self())
+      return EPERM;
+    if (--mutex->count > 0)
+      return 0;
+    mutex->owner = 0;
+  }
 
-  libslock_unlock(lock->lock);
+  PROFILE_RELEASED(raw_lock);
+  libslock_unlock(lock);
   return 0;
 }
 
@@ -158,7 +670,7 @@ static int interpose_cond_init(void *raw_cond, bool force)
   if (exactly_once(&cond->status) != 0)
     return 0;
 
-  cond->cond = (libslock_cond_t *)malloc((sizeof(libslock_cond_t)));
+  cond->cond = (libslock_cond_t *)slab_alloc(&cond_cache);
 
   int res = libslock_cond_init(cond->cond);
   cond->status = 2;
@@ -169,9 +681,40 @@ static int interpose_cond_destroy(void *raw_cond)
 {
   condvar_as_t *cond = CAST_TO_COND(raw_cond);
 
+  int res = 0;
   if (LIKELY(cond->status == 2))
-    return libslock_cond_destroy(cond->cond);
-  return 0;
+  {
+    res = libslock_cond_destroy(cond->cond);
+    slab_free(&cond_cache, cond->cond);
+    cond->status = 0;
+  }
+  return res;
+}
+
+/*
+ * Condition waits release recursive mutexes whatever their recursion count,
+ * restored once reacquired.
+ */
+static inline bool release_owner(lock_as_t *lock, uint32_t *count)
+{
+  *count = 0;
+  if (LIKELY(!tracks_owner(lock)))
+    return true;
+  if (lock->owner != get_self())
+    return false;
+
+  *count = lock->count;
+  lock->owner = 0;
+  return true;
+}
+
+static inline void restore_owner(lock_as_t *lock, uint32_t count)
+{
+  if (UNLIKELY(count))
+  {
+    lock->owner = get_self();
+    lock->count = count;
+  }
 }
 
 static int interpose_cond_timedwait(void *raw_cond, void *raw_lock, const struct timespec *abstime)
@@ -180,11 +723,17 @@ static int interpose_cond_timedwait(void *raw_cond, void *raw_lock, const struct
   if (UNLIKELY(cond->status != 2))
     interpose_cond_init(raw_cond, false);
 
-  lock_as_t *lock = CAST_TO_LOCK(raw_lock);
-  if (UNLIKELY(lock->status != 2))
-    interpose_lock_init(raw_lock, false);
+  libslock_t *lock = get_lock(raw_lock);
+  uint32_t count;
+  if (UNLIKELY(!release_owner(CAST_TO_LOCK(raw_lock), &count)))
+    return EPERM;
 
-  return libslock_cond_timedwait(cond->cond, lock->lock, abstime);
+  PROFILE_RELEASED(raw_lock);
+  int res = libslock_cond_timedwait(cond->cond, lock, abstime);
+  PROFILE_REACQUIRED(raw_lock);
+
+  restore_owner(CAST_TO_LOCK(raw_lock), count);
+  return res;
 }
 
 static int interpose_cond_wait(void *raw_cond, void *raw_lock)
@@ -193,11 +742,17 @@ static int interpose_cond_wait(void *raw_cond, void *raw_lock)
   if (UNLIKELY(cond->status != 2))
     interpose_cond_init(raw_cond, false);
 
-  lock_as_t *lock = CAST_TO_LOCK(raw_lock);
-  if (UNLIKELY(lock->status != 2))
-    interpose_lock_init(raw_lock, false);
+  libslock_t *lock = get_lock(raw_lock);
+  uint32_t count;
+  if (UNLIKELY(!release_owner(CAST_TO_LOCK(raw_lock), &count)))
+    return EPERM;
+
+  PROFILE_RELEASED(raw_lock);
+  int res = libslock_cond_wait(cond->cond, lock);
+  PROFILE_REACQUIRED(raw_lock);
 
-  return libslock_cond_wait(cond->cond, lock->lock);
+  restore_owner(CAST_TO_LOCK(raw_lock), count);
+  return res;
 }
 
 static int interpose_cond_signal(void *raw_cond)
@@ -221,8 +776,11 @@ static int interpose_cond_broadcast(void *raw_cond)
 int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
 {
   TEST_INTERPOSITION();
-  DASSERT(sizeof(pthread_mutex_t) > sizeof(lock_as_t));
-  return interpose_lock_init(mutex, true);
+
+  int type = PTHREAD_MUTEX_DEFAULT;
+  if (attr)
+    pthread_mutexattr_gettype(attr, &type);
+  return interpose_lock_init(mutex, __builtin_return_address(0), type, true);
 }
 
 int pthread_mutex_destroy(pthread_mutex_t *mutex)
@@ -240,8 +798,7 @@ int pthread_mutex_lock(pthread_mutex_t *mutex)
 int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime)
 {
   TEST_INTERPOSITION();
-  fprintf(stderr, "Timed locks not supported\n");
-  exit(EXIT_FAILURE);
+  return interpose_lock_timedlock(mutex, abstime);
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex)
@@ -298,108 +855,293 @@ int pthread_cond_broadcast(pthread_cond_t *cond)
 int pthread_spin_init(pthread_spinlock_t *spin, int pshared)
 {
   TEST_INTERPOSITION();
-  DASSERT(sizeof(pthread_spinlock_t) > sizeof(lock_as_t));
-  return interpose_lock_init((void *)spin, true);
+  return libslock_spin_init((libslock_spinlock_t *)spin);
 }
 
 int pthread_spin_destroy(pthread_spinlock_t *spin)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_destroy((void *)spin);
+  libslock_spin_destroy((libslock_spinlock_t *)spin);
+  return 0;
 }
 
 int pthread_spin_lock(pthread_spinlock_t *spin)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_lock((void *)spin);
+  libslock_spin_lock((libslock_spinlock_t *)spin);
+  return 0;
 }
 
 int pthread_spin_trylock(pthread_spinlock_t *spin)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_trylock((void *)spin);
+  return libslock_spin_trylock((libslock_spinlock_t *)spin);
 }
 
 int pthread_spin_unlock(pthread_spinlock_t *spin)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_unlock((void *)spin);
+  libslock_spin_unlock((libslock_spinlock_t *)spin);
+  return 0;
+}
+#endif
+
+// Semaphores, errors are reported through errno
+#if INTERPOSE_SEMAPHORE
+#define SEM_RETURN(res) \
+  do                    \
+  {                     \
+    int _res = (res);   \
+    if (_res == 0)      \
+      return 0;         \
+    errno = _res;       \
+    return -1;          \
+  } while (0)
+
+#define IS_INTERPOSED_SEM(sem) (CAST_TO_SEM(sem)->tag == SEM_TAG)
+
+int sem_init(sem_t *sem, int pshared, unsigned int value)
+{
+  TEST_INTERPOSITION();
+  sem_as_t *s = CAST_TO_SEM(sem);
+  s->tag = 0; // May have been one of ours
+
+  if (pshared)
+    return REAL(sem_init)(sem, pshared, value);
+
+  int res = libslock_sem_init(&s->sem, pshared, value);
+  if (res == 0)
+    s->tag = SEM_TAG;
+  SEM_RETURN(res);
+}
+
+int sem_destroy(sem_t *sem)
+{
+  TEST_INTERPOSITION();
+  if (!IS_INTERPOSED_SEM(sem))
+    return REAL(sem_destroy)(sem);
+
+  CAST_TO_SEM(sem)->tag = 0;
+  SEM_RETURN(libslock_sem_destroy(&CAST_TO_SEM(sem)->sem));
+}
+
+int sem_wait(sem_t *sem)
+{
+  TEST_INTERPOSITION();
+  if (!IS_INTERPOSED_SEM(sem))
+    return REAL(sem_wait)(sem);
+  SEM_RETURN(libslock_sem_wait(&CAST_TO_SEM(sem)->sem));
+}
+
+int sem_trywait(sem_t *sem)
+{
+  TEST_INTERPOSITION();
+  if (!IS_INTERPOSED_SEM(sem))
+    return REAL(sem_trywait)(sem);
+  SEM_RETURN(libslock_sem_trywait(&CAST_TO_SEM(sem)->sem));
+}
+
+int sem_timedwait(sem_t *sem, const struct timespec *abstime)
+{
+  TEST_INTERPOSITION();
+  if (!IS_INTERPOSED_SEM(sem))
+    return REAL(sem_timedwait)(sem, abstime);
+  SEM_RETURN(libslock_sem_timedwait(&CAST_TO_SEM(sem)->sem, abstime));
+}
+
+int sem_post(sem_t *sem)
+{
+  TEST_INTERPOSITION();
+  if (!IS_INTERPOSED_SEM(sem))
+    return REAL(sem_post)(sem);
+  SEM_RETURN(libslock_sem_post(&CAST_TO_SEM(sem)->sem));
+}
+
+int sem_getvalue(sem_t *sem, int *value)
+{
+  TEST_INTERPOSITION();
+  if (!IS_INTERPOSED_SEM(sem))
+    return REAL(sem_getvalue)(sem, value);
+  SEM_RETURN(libslock_sem_getvalue(&CAST_TO_SEM(sem)->sem, value));
 }
 #endif
 
 // Rw locks
 #if INTERPOSE_RWLOCK
+static int interpose_rwlock_init(void *raw_lock, void *caller, bool force)
+{
+#ifdef INTERPOSE_EMBEDDED
+  if (!force)
+    return 0; // Zeroed locks are ready to use
+  return libslock_rwlock_init_for((libslock_rwlock_t *)raw_lock, raw_lock, caller);
+#else
+  rwlock_as_t *lock = CAST_TO_RWLOCK(raw_lock);
+
+  if (force)
+    lock->status = 0;
+
+  if (exactly_once(&lock->status) != 0)
+    return 0;
+
+  lock->lock = (libslock_rwlock_t *)slab_alloc(&rwlock_cache);
+
+  int res = libslock_rwlock_init_for(lock->lock, raw_lock, caller);
+  lock->status = 2;
+  return res;
+#endif
+}
+
+/*
+ * Rwlock of a pthread object, initialized on first use.
+ */
+static inline libslock_rwlock_t *get_rwlock(void *raw_lock)
+{
+#ifdef INTERPOSE_EMBEDDED
+  return (libslock_rwlock_t *)raw_lock;
+#else
+  rwlock_as_t *lock = CAST_TO_RWLOCK(raw_lock);
+
+  if (UNLIKELY(lock->status != 2))
+    interpose_rwlock_init(raw_lock, NULL, false);
+
+  return lock->lock;
+#endif
+}
+
+static int interpose_rwlock_destroy(void *raw_lock)
+{
+#ifdef INTERPOSE_EMBEDDED
+  libslock_rwlock_destroy((libslock_rwlock_t *)raw_lock);
+  return 0;
+#else
+  rwlock_as_t *lock = CAST_TO_RWLOCK(raw_lock);
+  if (LIKELY(lock->status == 2))
+  {
+    libslock_rwlock_destroy(lock->lock);
+    slab_free(&rwlock_cache, lock->lock);
+    lock->status = 0;
+  }
+
+  return 0;
+#endif
+}
+
+static int interpose_rwlock_rdlock(void *raw_lock)
+{
+  libslock_rwlock_rdlock(get_rwlock(raw_lock));
+  return 0;
+}
+
+static int interpose_rwlock_wrlock(void *raw_lock)
+{
+  libslock_rwlock_wrlock(get_rwlock(raw_lock));
+  return 0;
+}
+
+static int interpose_rwlock_tryrdlock(void *raw_lock)
+{
+  return libslock_rwlock_tryrdlock(get_rwlock(raw_lock));
+}
+
+static int interpose_rwlock_trywrlock(void *raw_lock)
+{
+  return libslock_rwlock_trywrlock(get_rwlock(raw_lock));
+}
+
+static int interpose_rwlock_timedrdlock(void *raw_lock, const struct timespec *abstime)
+{
+  return libslock_rwlock_timedrdlock(get_rwlock(raw_lock), abstime);
+}
+
+static int interpose_rwlock_timedwrlock(void *raw_lock, const struct timespec *abstime)
+{
+  return libslock_rwlock_timedwrlock(get_rwlock(raw_lock), abstime);
+}
+
+static int interpose_rwlock_unlock(void *raw_lock)
+{
+  libslock_rwlock_unlock(get_rwlock(raw_lock));
+  return 0;
+}
+
 int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr)
 {
   TEST_INTERPOSITION();
-  DASSERT(sizeof(pthread_rwlock_t) > sizeof(lock_as_t));
-  return interpose_lock_init((void *)rwlock, true);
+  DASSERT(sizeof(pthread_rwlock_t) > sizeof(rwlock_as_t));
+  return interpose_rwlock_init((void *)rwlock, __builtin_return_address(0), true);
 }
 
 int pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_destroy((void *)rwlock);
+  return interpose_rwlock_destroy((void *)rwlock);
 }
 
 int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_lock((void *)rwlock);
+  return interpose_rwlock_rdlock((void *)rwlock);
 }
 
 int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_lock((void *)rwlock);
+  return interpose_rwlock_wrlock((void *)rwlock);
 }
 
-int pthread_rwlock_timedrdlock(pthread_rwlock_t *lcok, const struct timespec *abstime)
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock, const struct timespec *abstime)
 {
   TEST_INTERPOSITION();
-  fprintf(stderr, "Timed locks not supported\n");
-  exit(EXIT_FAILURE);
+  return interpose_rwlock_timedrdlock((void *)rwlock, abstime);
 }
 
-int pthread_rwlock_timedwrlock(pthread_rwlock_t *lock, const struct timespec *abstime)
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock, const struct timespec *abstime)
 {
   TEST_INTERPOSITION();
-  fprintf(stderr, "Timed locks not supported\n");
-  exit(EXIT_FAILURE);
+  return interpose_rwlock_timedwrlock((void *)rwlock, abstime);
 }
 
 int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_trylock((void *)rwlock);
+  return interpose_rwlock_tryrdlock((void *)rwlock);
 }
 
 int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_trylock((void *)rwlock);
+  return interpose_rwlock_trywrlock((void *)rwlock);
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
 {
   TEST_INTERPOSITION();
-  return interpose_lock_unlock((void *)rwlock);
+  return interpose_rwlock_unlock((void *)rwlock);
 }
 #endif
 
 #if INTERPOSE_BARRIERS
-static int interpose_barrier_init(void *raw_barrier, void *attr, int count)
+static int interpose_barrier_init(void *raw_barrier, void *attr, int count, bool force)
 {
   barrier_as_t *barrier = (barrier_as_t *)raw_barrier;
 
+  if (force)
+    barrier->status = 0;
+
   if (exactly_once(&barrier->status) != 0)
     return 0;
 
-  barrier->barrier = (libslock_barrier_t *)malloc((sizeof(libslock_barrier_t)));
+  barrier->barrier = (libslock_barrier_t *)slab_alloc(&barrier_cache);
 
   int res = libslock_barrier_init(barrier->barrier, (libslock_barrierattr_t *)attr, count);
+  if (res != 0)
+  {
+    slab_free(&barrier_cache, barrier->barrier);
+    barrier->status = 0;
+    return res;
+  }
   barrier->status = 2;
-  return res;
+  return 0;
 }
 
 static int interpose_barrier_destroy(void *raw_barrier)
@@ -408,8 +1150,10 @@ static int interpose_barrier_destroy(void *raw_barrier)
 
   if (LIKELY(barrier->status == 2))
   {
-    libslock_barrier_destroy(barrier->barrier);
-    free(barrier->barrier);
+    int res = libslock_barrier_destroy(barrier->barrier);
+    if (res != 0)
+      return res;
+    slab_free(&barrier_cache, barrier->barrier);
     barrier->status = 0;
   }
 
@@ -430,7 +1174,7 @@ int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t
 {
   TEST_INTERPOSITION();
   DASSERT(sizeof(pthread_barrier_t) > sizeof(barrier_as_t));
-  return interpose_barrier_init((void *)barrier, (void *)attr, count);
+  return interpose_barrier_init((void *)barrier, (void *)attr, count, true);
 }
 
 int pthread_barrier_destroy(pthread_barrier_t *barrier)
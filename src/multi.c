@@ -0,0 +1,344 @@
+/*
+ * File: multi.c
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      All locks in a single library, picked per lock at run time
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <string.h>
+
+#include "multi.h"
+
+#ifndef MULTI_OPS_LIST
+#error "MULTI_OPS_LIST not defined"
+#endif
+
+#define MULTI_OPS(name) extern const multi_ops_t multi_ops_##name;
+MULTI_OPS_LIST
+#undef MULTI_OPS
+
+#define MULTI_OPS(name) &multi_ops_##name,
+static const multi_ops_t *const all_ops[] = {MULTI_OPS_LIST};
+#undef MULTI_OPS
+
+#define NUM_OPS (sizeof(all_ops) / sizeof(all_ops[0]))
+#define MAX_RULES 64
+#define MAX_RULE_LENGTH 256
+
+typedef enum
+{
+  MATCH_CALLER,
+  MATCH_ADDR,
+  MATCH_TYPE,
+} match_t;
+
+typedef struct rule_t
+{
+  const multi_ops_t *ops;
+  match_t match;
+  char object[MAX_RULE_LENGTH]; // Range relative to this object if not empty
+  uintptr_t start, end;
+  int type;
+} rule_t;
+
+static rule_t rules[MAX_RULES];
+static int num_rules = 0;
+static const multi_ops_t *default_ops;
+
+const multi_ops_t *multi_ops_by_name(const char *name)
+{
+  for (int i = 0; i < NUM_OPS; i++)
+    if (strcasecmp(all_ops[i]->name, name) == 0)
+      return all_ops[i];
+  return NULL;
+}
+
+static int parse_type(const char *name)
+{
+  if (strcasecmp(name, "normal") == 0)
+    return PTHREAD_MUTEX_NORMAL;
+  if (strcasecmp(name, "recursive") == 0)
+    return PTHREAD_MUTEX_RECURSIVE;
+  if (strcasecmp(name, "errorcheck") == 0)
+    return PTHREAD_MUTEX_ERRORCHECK;
+  if (strcasecmp(name, "adaptive") == 0)
+    return PTHREAD_MUTEX_ADAPTIVE_NP;
+  return -1;
+}
+
+/*
+ * [<object>+]<start>-<end>
+ */
+static int parse_range(char *range, rule_t *rule)
+{
+  char *end, *plus = strrchr(range, '+');
+
+  if (plus)
+  {
+    *plus = '\0';
+    strncpy(rule->object, range, MAX_RULE_LENGTH - 1);
+    range = plus + 1;
+  }
+
+  rule->start = strtoull(range, &end, 0);
+  if (*end != '-')
+    return -1;
+  rule->end = strtoull(end + 1, &end, 0);
+  return *end == '\0' && rule->start < rule->end ? 0 : -1;
+}
+
+/*
+ * <lock>[@<match>=<value>]
+ */
+static void parse_rule(char *text)
+{
+  while (isspace(*text))
+    text++;
+  for (char *end = text + strlen(text); end > text && isspace(end[-1]); end--)
+    end[-1] = '\0';
+  if (*text == '\0')
+    return;
+
+  rule_t rule_data = {0}, *rule = &rule_data;
+
+  char *match = strchr(text, '@');
+  if (match)
+    *match++ = '\0';
+
+  if (!(rule->ops = multi_ops_by_name(text)))
+  {
+    fprintf(stderr, "Unknown lock %s, ignoring rule.\n", text);
+    return;
+  }
+
+  if (!match)
+  {
+    default_ops = rule->ops;
+    return;
+  }
+
+  char *value = strchr(match, '=');
+  if (!value)
+    goto invalid;
+  *value++ = '\0';
+
+  if (strcmp(match, "caller") == 0 || strcmp(match, "addr") == 0)
+  {
+    rule->match = strcmp(match, "caller") == 0 ? MATCH_CALLER : MATCH_ADDR;
+    if (parse_range(value, rule) != 0)
+      goto invalid;
+  }
+  else if (strcmp(match, "type") == 0)
+  {
+    rule->match = MATCH_TYPE;
+    if ((rule->type = parse_type(value)) < 0)
+      goto invalid;
+  }
+  else
+    goto invalid;
+
+  if (num_rules == MAX_RULES)
+  {
+    fprintf(stderr, "Too many lock rules, ignoring the rest.\n");
+    return;
+  }
+  rules[num_rules++] = *rule;
+  return;
+
+invalid:
+  fprintf(stderr, "Invalid lock rule %s@%s, ignoring.\n", text, match);
+}
+
+static void parse_rules(char *text)
+{
+  char *saveptr, *token, *comment = strchr(text, '#');
+  if (comment)
+    *comment = '\0';
+
+  for (token = strtok_r(text, ",\n", &saveptr); token; token = strtok_r(NULL, ",\n", &saveptr))
+    parse_rule(token);
+}
+
+static void load_rules()
+{
+  static volatile uint8_t init_lock = 0;
+  if (exactly_once(&init_lock) != 0)
+    return;
+
+  default_ops = all_ops[0];
+
+  char line[MAX_RULE_LENGTH];
+  const char *path = getenv("MULTI_LOCK_CONFIG");
+  if (path)
+  {
+    FILE *file = fopen(path, "r");
+    if (file)
+    {
+      while (fgets(line, MAX_RULE_LENGTH, file))
+        parse_rules(line);
+      fclose(file);
+    }
+    else
+      perror("MULTI_LOCK_CONFIG");
+  }
+
+  const char *env = getenv("MULTI_LOCK");
+  if (env)
+  {
+    char *copy = strdup(env);
+    parse_rules(copy);
+    free(copy);
+  }
+
+  __sync_synchronize();
+  init_lock = 2;
+}
+
+static int in_range(rule_t *rule, void *address)
+{
+  uintptr_t addr = (uintptr_t)address;
+
+  if (rule->object[0])
+  {
+    Dl_info info;
+    if (!address || !dladdr(address, &info) || !info.dli_fname)
+      return 0;
+
+    const char *name = strrchr(info.dli_fname, '/');
+    if (strcmp(name ? name + 1 : info.dli_fname, rule->object) != 0)
+      return 0;
+    addr -= (uintptr_t)info.dli_fbase;
+  }
+
+  return rule->start <= addr && addr < rule->end;
+}
+
+/*
+ * Lock to use for the object at address object, initialized from caller.
+ * type is the mutex type or -1 for other locks.
+ */
+const multi_ops_t *multi_select(void *object, void *caller, int type)
+{
+  load_rules();
+
+  for (int i = 0; i < num_rules; i++)
+  {
+    rule_t *rule = &rules[i];
+    if ((rule->match == MATCH_CALLER && in_range(rule, caller)) ||
+        (rule->match == MATCH_ADDR && in_range(rule, object)) ||
+        (rule->match == MATCH_TYPE && rule->type == type))
+      return rule->ops;
+  }
+
+  return default_ops;
+}
+
+int multi_init_for(multi_lock_t *the_lock, void *object, void *caller, int type)
+{
+  the_lock->ops = multi_select(object, caller, type);
+  return the_lock->ops->init(the_lock->lock);
+}
+
+int multi_init(multi_lock_t *the_lock)
+{
+  return multi_init_for(the_lock, the_lock, NULL, -1);
+}
+
+void multi_destroy(multi_lock_t *the_lock)
+{
+  the_lock->ops->destroy(the_lock->lock);
+}
+
+int multi_rwlock_init_for(multi_rwlock_t *the_lock, void *object, void *caller)
+{
+  the_lock->ops = multi_select(object, caller, -1);
+  return the_lock->ops->rwlock_init(the_lock->lock);
+}
+
+int multi_rwlock_init(multi_rwlock_t *the_lock)
+{
+  return multi_rwlock_init_for(the_lock, the_lock, NULL);
+}
+
+void multi_rwlock_destroy(multi_rwlock_t *the_lock)
+{
+  the_lock->ops->rwlock_destroy(the_lock->lock);
+}
+
+/*
+ *  Condition Variables
+ */
+
+int multi_cond_init(multi_cond_t *cond)
+{
+  cond->ops = NULL;
+  return 0;
+}
+
+/*
+ * Bound to the ops of the lock on wait, with the lock held. Signal and
+ * broadcast only need the ops once someone waited.
+ */
+static inline const multi_ops_t *cond_bind(multi_cond_t *cond, multi_lock_t *the_lock)
+{
+  const multi_ops_t *ops = the_lock->ops;
+  if (cond->ops != ops)
+  {
+    ops->cond_init(cond->cond);
+    __atomic_store_n(&cond->ops, ops, __ATOMIC_RELEASE);
+  }
+  return ops;
+}
+
+int multi_cond_wait(multi_cond_t *cond, multi_lock_t *the_lock)
+{
+  return cond_bind(cond, the_lock)->cond_wait(cond->cond, the_lock->lock);
+}
+
+int multi_cond_timedwait(multi_cond_t *cond, multi_lock_t *the_lock, const struct timespec *ts)
+{
+  return cond_bind(cond, the_lock)->cond_timedwait(cond->cond, the_lock->lock, ts);
+}
+
+int multi_cond_signal(multi_cond_t *cond)
+{
+  const multi_ops_t *ops = __atomic_load_n(&cond->ops, __ATOMIC_ACQUIRE);
+  return ops ? ops->cond_signal(cond->cond) : 0;
+}
+
+int multi_cond_broadcast(multi_cond_t *cond)
+{
+  const multi_ops_t *ops = __atomic_load_n(&cond->ops, __ATOMIC_ACQUIRE);
+  return ops ? ops->cond_broadcast(cond->cond) : 0;
+}
+
+int multi_cond_destroy(multi_cond_t *cond)
+{
+  const multi_ops_t *ops = cond->ops;
+  cond->ops = NULL;
+  return ops ? ops->cond_destroy(cond->cond) : 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * File: multi_ops.c
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      Ops table of one lock for the multi lock.
+ *      Compiled once per lock with -DUSE_<LOCK>_LOCKS -DMULTI_OPS=multi_ops_<lock>.
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+
+#undef USE_MULTI_LOCKS // Build flags of the multi lock itself
+#include "lock_if.h"
+#include "multi.h"
+
+#ifndef MULTI_OPS
+#error "MULTI_OPS not defined"
+#endif
+
+#define STR(s) #s
+#define XSTR(s) STR(s)
+
+static int ops_init(void *lock) { return libslock_init(lock); }
+static void ops_destroy(void *lock) { libslock_destroy(lock); }
+static void ops_lock(void *lock) { libslock_lock(lock); }
+static int ops_trylock(void *lock) { return libslock_trylock(lock); }
+static int ops_timedlock(void *lock, const struct timespec *abstime) { return libslock_timedlock(lock, abstime); }
+static void ops_unlock(void *lock) { libslock_unlock(lock); }
+
+static int ops_rwlock_init(void *lock) { return libslock_rwlock_init(lock); }
+static void ops_rwlock_destroy(void *lock) { libslock_rwlock_destroy(lock); }
+static void ops_rwlock_rdlock(void *lock) { libslock_rwlock_rdlock(lock); }
+static void ops_rwlock_wrlock(void *lock) { libslock_rwlock_wrlock(lock); }
+static int ops_rwlock_tryrdlock(void *lock) { return libslock_rwlock_tryrdlock(lock); }
+static int ops_rwlock_trywrlock(void *lock) { return libslock_rwlock_trywrlock(lock); }
+static int ops_rwlock_timedrdlock(void *lock, const struct timespec *abstime) { return libslock_rwlock_timedrdlock(lock, abstime); }
+static int ops_rwlock_timedwrlock(void *lock, const struct timespec *abstime) { return libslock_rwlock_timedwrlock(lock, abstime); }
+static void ops_rwlock_unlock(void *lock) { libslock_rwlock_unlock(lock); }
+
+#ifdef LOCKIF_COND_T
+typedef libslock_cond_t multi_ops_cond_t;
+
+static int ops_cond_init(void *cond) { return libslock_cond_init(cond); }
+static int ops_cond_destroy(void *cond) { return libslock_cond_destroy(cond); }
+static int ops_cond_wait(void *cond, void *lock) { return libslock_cond_wait(cond, lock); }
+static int ops_cond_timedwait(void *cond, void *lock, const struct timespec *abstime) { return libslock_cond_timedwait(cond, lock, abstime); }
+static int ops_cond_signal(void *cond) { return libslock_cond_signal(cond); }
+static int ops_cond_broadcast(void *cond) { return libslock_cond_broadcast(cond); }
+#else
+/*
+ * Generic condition variables for locks without their own
+ */
+typedef struct
+{
+  uint32_t seq;
+  uint32_t target;
+} multi_ops_cond_t;
+
+static int ops_cond_init(void *c)
+{
+  multi_ops_cond_t *cond = c;
+  cond->seq = 0;
+  cond->target = 0;
+  return 0;
+}
+
+static int ops_cond_destroy(void *c)
+{
+  return ops_cond_init(c);
+}
+
+static int ops_cond_signal(void *c)
+{
+  multi_ops_cond_t *cond = c;
+  cond->seq++;
+#ifndef CONDVARS_SPIN
+  futex_wake(&cond->seq, 1);
+#endif
+  return 0;
+}
+
+static int ops_cond_broadcast(void *c)
+{
+  multi_ops_cond_t *cond = c;
+  cond->seq = cond->target;
+#ifndef CONDVARS_SPIN
+  futex_wake(&cond->seq, INT_MAX);
+#endif
+  return 0;
+}
+
+static int ops_cond_timedwait(void *c, void *lock, const struct timespec *abstime)
+{
+  multi_ops_cond_t *cond = c;
+  if (abstime && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+    return EINVAL;
+
+  // No need for atomic operations, I have the lock
+  uint32_t target = ++cond->target;
+  uint32_t seq = cond->seq;
+  libslock_unlock(lock);
+
+  while (target > seq)
+  {
+#if defined(CONDVARS_SPIN)
+    PAUSE;
+#else
+    if (abstime)
+      futex_wait_until(&cond->seq, seq, abstime);
+    else
+      futex_wait(&cond->seq, seq);
+#endif
+    seq = cond->seq;
+
+    if (target > seq && abstime && deadline_passed(abstime))
+    {
+      libslock_lock(lock);
+      if (target <= cond->seq)
+        return 0; // Signaled in the meantime
+
+      // Give the slot back, see flexguard_cond_timedwait
+      if (target == cond->target)
+        cond->target--;
+      else
+        ops_cond_broadcast(cond);
+      return ETIMEDOUT;
+    }
+  }
+  libslock_lock(lock);
+  return 0;
+}
+
+static int ops_cond_wait(void *cond, void *lock)
+{
+  return ops_cond_timedwait(cond, lock, NULL);
+}
+#endif
+
+_Static_assert(sizeof(libslock_t) <= MULTI_LOCK_SIZE && _Alignof(libslock_t) <= MULTI_ALIGN,
+               "Stale multi_size.h, run make clean");
+_Static_assert(sizeof(libslock_rwlock_t) <= MULTI_RWLOCK_SIZE && _Alignof(libslock_rwlock_t) <= MULTI_ALIGN,
+               "Stale multi_size.h, run make clean");
+_Static_assert(sizeof(multi_ops_cond_t) <= MULTI_COND_SIZE && _Alignof(multi_ops_cond_t) <= MULTI_ALIGN,
+               "Stale multi_size.h, run make clean");
+
+const multi_ops_t MULTI_OPS = {
+    .name = XSTR(MULTI_OPS) + sizeof("multi_ops_") - 1,
+
+    .init = ops_init,
+    .destroy = ops_destroy,
+    .lock = ops_lock,
+    .trylock = ops_trylock,
+    .timedlock = ops_timedlock,
+    .unlock = ops_unlock,
+
+    .rwlock_init = ops_rwlock_init,
+    .rwlock_destroy = ops_rwlock_destroy,
+    .rwlock_rdlock = ops_rwlock_rdlock,
+    .rwlock_wrlock = ops_rwlock_wrlock,
+    .rwlock_tryrdlock = ops_rwlock_tryrdlock,
+    .rwlock_trywrlock = ops_rwlock_trywrlock,
+    .rwlock_timedrdlock = ops_rwlock_timedrdlock,
+    .rwlock_timedwrlock = ops_rwlock_timedwrlock,
+    .rwlock_unlock = ops_rwlock_unlock,
+
+    .cond_init = ops_cond_init,
+    .cond_destroy = ops_cond_destroy,
+    .cond_wait = ops_cond_wait,
+    .cond_timedwait = ops_cond_timedwait,
+    .cond_signal = ops_cond_signal,
+    .cond_broadcast = ops_cond_broadcast,
+};
@@ -0,0 +1,55 @@
+/*
+ * File: multi_size.c
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      Prints the storage needed by one lock for the multi lock.
+ *      Built and run once per lock by the Makefile to generate multi_size.h.
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#undef USE_MULTI_LOCKS // Build flags of the multi lock itself
+#include "lock_if.h"
+
+// Condition variable of multi_ops.c, checked against multi_size.h there
+#ifdef LOCKIF_COND_T
+typedef libslock_cond_t multi_ops_cond_t;
+#else
+typedef struct
+{
+  uint32_t seq;
+  uint32_t target;
+} multi_ops_cond_t;
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+int main()
+{
+  size_t align = MAX(_Alignof(libslock_t), _Alignof(libslock_rwlock_t));
+  align = MAX(align, _Alignof(multi_ops_cond_t));
+
+  // lock rwlock cond align, maximum over all locks taken by the Makefile
+  printf("%zu %zu %zu %zu\n", sizeof(libslock_t), sizeof(libslock_rwlock_t), sizeof(multi_ops_cond_t), align);
+  return 0;
+}
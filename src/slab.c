@@ -0,0 +1,192 @@
+/*
+ * File: slab.c
+ * Author: Victor Laforet <victor.laforet@inria.fr>
+ *
+ * Description:
+ *      Per-thread slab allocator of cache-line-aligned objects
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Victor Laforet
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+
+#include "atomic_ops.h"
+#include "slab.h"
+
+typedef union
+{
+  slab_thread_t *owner;
+  uint8_t padding[CACHE_LINE_SIZE];
+} slab_header_t;
+
+static _Atomic(int) cache_count = 0;
+static slab_cache_t *caches[SLAB_MAX_CACHES];
+static pthread_key_t slab_key;
+static __thread slab_thread_t *slab_me[SLAB_MAX_CACHES];
+
+/*
+ * Hand the slabs of an exiting thread over to the next new thread.
+ */
+static void slab_thread_exit(void *UNUSED(value))
+{
+  for (int i = 0; i < SLAB_MAX_CACHES; i++)
+  {
+    slab_thread_t *me = slab_me[i];
+    if (!me)
+      continue;
+
+    slab_cache_t *cache = caches[i];
+    while (tas_uint8(&cache->orphans_lock))
+      RAW_PAUSE;
+    me->next_orphan = cache->orphans;
+    cache->orphans = me;
+    cache->orphans_lock = 0;
+
+    slab_me[i] = NULL;
+  }
+}
+
+static void slab_cache_init(slab_cache_t *cache)
+{
+  static volatile uint8_t key_init = 0;
+  if (exactly_once(&key_init) == 0)
+  {
+    pthread_key_create(&slab_key, slab_thread_exit);
+    key_init = 2;
+  }
+
+  if (exactly_once(&cache->status) != 0)
+    return;
+
+  cache->object_size = (cache->object_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+  cache->slab_size = SLAB_MIN_SIZE;
+  while (cache->slab_size < sizeof(slab_header_t) + SLAB_MIN_OBJECTS * cache->object_size)
+    cache->slab_size *= 2;
+
+  cache->index = cache_count++;
+  if (cache->index >= SLAB_MAX_CACHES)
+  {
+    fprintf(stderr, "Too many slab caches, increase SLAB_MAX_CACHES.\n");
+    exit(EXIT_FAILURE);
+  }
+  caches[cache->index] = cache;
+
+  __sync_synchronize();
+  cache->status = 2;
+}
+
+static slab_thread_t *slab_thread_init(slab_cache_t *cache)
+{
+  slab_thread_t *me;
+
+  while (tas_uint8(&cache->orphans_lock))
+    RAW_PAUSE;
+  if ((me = cache->orphans))
+    cache->orphans = me->next_orphan;
+  cache->orphans_lock = 0;
+
+  if (!me)
+  {
+    if (!(me = (slab_thread_t *)aligned_alloc(CACHE_LINE_SIZE, sizeof(slab_thread_t))))
+    {
+      perror("slab_thread_init");
+      exit(EXIT_FAILURE);
+    }
+    me->free = NULL;
+    me->remote_free = NULL;
+  }
+  me->next_orphan = NULL;
+
+  slab_me[cache->index] = me;
+  pthread_setspecific(slab_key, (void *)slab_me);
+  return me;
+}
+
+/*
+ * Map a slab aligned on its size. Pages are first touched by the owner when
+ * building the free list, allocating them on its NUMA node.
+ */
+static void slab_grow(slab_cache_t *cache, slab_thread_t *me)
+{
+  size_t size = cache->slab_size;
+  uint8_t *map = (uint8_t *)mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+  {
+    perror("slab mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  uint8_t *slab = (uint8_t *)(((uintptr_t)map + size - 1) & ~(size - 1));
+  if (slab > map)
+    munmap(map, slab - map);
+  munmap(slab + size, map + size - slab);
+
+  ((slab_header_t *)slab)->owner = me;
+
+  size_t i, count = (size - sizeof(slab_header_t)) / cache->object_size;
+  for (i = 0; i < count; i++)
+  {
+    slab_object_t *object = (slab_object_t *)(slab + sizeof(slab_header_t) + i * cache->object_size);
+    object->next = me->free;
+    me->free = object;
+  }
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+  if (UNLIKELY(cache->status != 2))
+    slab_cache_init(cache);
+
+  slab_thread_t *me = slab_me[cache->index];
+  if (UNLIKELY(!me))
+    me = slab_thread_init(cache);
+
+  if (UNLIKELY(!me->free))
+  {
+    me->free = (slab_object_t *)__sync_lock_test_and_set(&me->remote_free, NULL);
+    if (!me->free)
+      slab_grow(cache, me);
+  }
+
+  slab_object_t *object = me->free;
+  me->free = object->next;
+  return object;
+}
+
+void slab_free(slab_cache_t *cache, void *ptr)
+{
+  slab_object_t *object = (slab_object_t *)ptr;
+  slab_header_t *slab = (slab_header_t *)((uintptr_t)object & ~(cache->slab_size - 1));
+  slab_thread_t *owner = slab->owner;
+
+  if (owner == slab_me[cache->index])
+  {
+    object->next = owner->free;
+    owner->free = object;
+    return;
+  }
+
+  do
+    object->next = owner->remote_free;
+  while (!__sync_bool_compare_and_swap(&owner->remote_free, object->next, object));
+}
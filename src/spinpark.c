@@ -34,7 +34,7 @@
 #endif
 
 #ifdef DEBUG
-__thread uint8_t locked_thread = 0;
+static __thread uint8_t locked_thread = 0;
 #endif
 
 int spinpark_trylock(spinpark_lock_t *lock)
@@ -60,10 +60,12 @@ void spinpark_lock(spinpark_lock_t *lock)
 
   if (state != 0)
   {
+    LOCK_EVENT(slow_paths);
     if (state != 2)
       state = __sync_lock_test_and_set(&lock->data, 2);
     while (state != 0)
     {
+      LOCK_EVENT(sleeps);
       futex_wait((void *)&lock->data, 2);
       state = __sync_lock_test_and_set(&lock->data, 2);
     }